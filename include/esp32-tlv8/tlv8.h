@@ -33,6 +33,7 @@ extern "C" {
 #ifndef _TLV8_H
 #define _TLV8_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include "mbedtls/bignum.h"
 #include "esp32-utils/utils.h"
@@ -50,6 +51,14 @@ extern "C" {
 #define TLV8_ERR_INVALID_TYPE           -0x0008
 #define TLV8_ERR_ALLOC_FAILED           -0x000A
 #define TLV8_ERR_OUT_OF_MEMORY          TLV8_ERR_ALLOC_FAILED
+#define TLV8_ERR_IO_FAILED              -0x000C
+#define TLV8_ERR_INVALID_CAPTURE        -0x000E
+#define TLV8_ERR_INVALID_NESTING        -0x0010
+#define TLV8_ERR_RING_FULL              -0x0012
+
+#define TLV8_TEMPLATE_MAX_SLOTS         16
+#define TLV8_MAX_NESTING_DEPTH          4
+#define TLV8_PARSE_MAX_SPANS            8
 
 #define ESP32_TLV8_CHK(f) \
 if (( ret = f ) != TLV8_ERR_OK) { \
@@ -64,10 +73,66 @@ typedef enum {
     TLV8_DATA_TYPE_MPI
 } TLV8_DATA_TYPE;
 
+// Fragment of a tlv value, in place in the encoded data
+typedef struct {
+    const unsigned char     *data;
+    int                     len;
+} tlv8_span_t;
+
+// Parser callback. data is set when the value is in a single fragment, spans
+// lists the fragments, at most TLV8_PARSE_MAX_SPANS per call. A value in more
+// fragments takes several calls, it is complete once the spans add up to len.
+// Returning non zero stops parsing
+typedef int (*tlv8_handler_cb_t)(void *ctx, uint8_t type, const unsigned char *data, int len, const tlv8_span_t *spans, int num_spans);
+
+typedef struct {
+    tlv8_handler_cb_t       callback;
+    void                    *ctx;
+} tlv8_handler_t;
+
+// Allocator used for tlvs, codecs and the payloads they own
+typedef struct {
+    void *(*alloc)(void *ctx, size_t size);
+    void (*release)(void *ctx, void *ptr);
+    void *ctx;
+} tlv8_allocator_t;
+
+// malloc / free
+extern const tlv8_allocator_t tlv8_allocator_default;
+// heap_caps_malloc in internal RAM
+extern const tlv8_allocator_t tlv8_allocator_internal;
+// heap_caps_malloc in external PSRAM
+extern const tlv8_allocator_t tlv8_allocator_spiram;
+
 struct _tlv8;
 typedef struct _tlv8 *tlv8_t;
 typedef struct _tlv8_encoder *tlv8_encoder_t;
+// Output callback, returns 0 on success
+typedef int (*tlv8_sink_t)(void *ctx, const void *data, int len);
 typedef struct _tlv8_decoder *tlv8_decoder_t;
+typedef struct _tlv8_template *tlv8_template_t;
+typedef struct _tlv8_message *tlv8_message_t;
+typedef struct _tlv8_cache *tlv8_cache_t;
+typedef struct _tlv8_cache_entry *tlv8_cache_entry_t;
+typedef struct _tlv8_ring *tlv8_ring_t;
+typedef struct _tlv8_pool *tlv8_pool_t;
+
+// Allocator methods
+// Set the allocator used by objects created from now on, NULL restores the default.
+// The allocator must outlive every object created with it. Headers holding locks or
+// refcounts always come from internal RAM, the allocator only provides their data
+void tlv8_set_allocator(const tlv8_allocator_t *allocator);
+const tlv8_allocator_t *tlv8_get_allocator();
+// Initialize an allocator using heap_caps_malloc with the given capabilities
+void tlv8_allocator_init_heap_caps(tlv8_allocator_t *allocator, uint32_t caps);
+// Create a pool of num_blocks blocks of block_size bytes carved from storage, 8 byte aligned,
+// or allocated with the pool if storage is NULL. Allocations larger than a block or made when
+// the pool is exhausted are passed to the fallback allocator, if any
+tlv8_pool_t tlv8_pool_new(void *storage, size_t block_size, int num_blocks, const tlv8_allocator_t *fallback);
+// Allocator handing out the pool blocks, valid until the pool is freed
+const tlv8_allocator_t *tlv8_pool_get_allocator(tlv8_pool_t pool);
+// Cleanup, every block must have been released
+void tlv8_pool_free(void *pool);
 
 // TLV8 methods
 // Create a new TLV8 separator
@@ -76,7 +141,8 @@ tlv8_t tlv8_new_separator(uint8_t type);
 tlv8_t tlv8_new_with_integer(uint8_t type, uint64_t integer);
 // Create a new TLV8 structure from string
 tlv8_t tlv8_new_with_string(uint8_t type, const char *string);
-// Create a new TLV8 structure from data
+// Create a new TLV8 structure from data. Data, strings and mpis are copied with the
+// current allocator, an mpi is then only rebuilt by tlv8_get_mpi_value
 tlv8_t tlv8_new_with_data(uint8_t type, void *data, int data_len);
 // Create a new TLV8 structure from buffer (type TLV8_DATA_TYPE_BYTES)
 tlv8_t tlv8_new_with_buffer(uint8_t type, buffer_t data);
@@ -87,6 +153,9 @@ uint8_t tlv8_get_type(tlv8_t tlv);
 uint64_t tlv8_get_integer_value(tlv8_t tlv);
 const char *tlv8_get_string_value(tlv8_t tlv);
 buffer_t tlv8_get_data_value(tlv8_t tlv);
+// Data value in place, a decoded tlv may share the decoder buffer instead of holding a copy
+const unsigned char *tlv8_get_bytes_value(tlv8_t tlv);
+int tlv8_get_length(tlv8_t tlv);
 mbedtls_mpi *tlv8_get_mpi_value(tlv8_t tlv);
 // Cleanup
 void tlv8_free(void *tlv);
@@ -94,18 +163,46 @@ void tlv8_free(void *tlv);
 // TLV8 codec methods
 // Create a new TLV8 codec encoder.
 tlv8_encoder_t tlv8_encoder_new(buffer_t buffer);
+// Create a new TLV8 codec encoder using a specific allocator
+tlv8_encoder_t tlv8_encoder_new_with_allocator(buffer_t buffer, const tlv8_allocator_t *allocator);
+// Create a new TLV8 codec encoder writing base64 text in buffer (created if NULL)
+tlv8_encoder_t tlv8_encoder_new_base64(buffer_t buffer);
+// Create a new TLV8 codec encoder writing base64 text to a sink
+tlv8_encoder_t tlv8_encoder_new_base64_with_sink(tlv8_sink_t sink, void *ctx);
+// Create a new TLV8 codec encoder writing to a sink
+tlv8_encoder_t tlv8_encoder_new_with_sink(tlv8_sink_t sink, void *ctx);
 // Add and encode a tlv on this codec
 int tlv8_encoder_encode(tlv8_encoder_t codec, tlv8_t tlv);
-// Get data buffer
+// Write the final padded base64 group, once after the last tlv
+int tlv8_encoder_finish(tlv8_encoder_t codec);
+// Start a new message on a sink encoder
+int tlv8_encoder_reset(tlv8_encoder_t codec);
+// Start a tlv whose value is made of the tlvs encoded until tlv8_encoder_end_nested.
+// Not available on base64 or sink encoders
+int tlv8_encoder_begin_nested(tlv8_encoder_t codec, uint8_t type);
+// Close the innermost nested tlv, fragmenting it in place if needed
+int tlv8_encoder_end_nested(tlv8_encoder_t codec);
+// Get data buffer, NULL while a nested tlv is open
 buffer_t tlv8_encoder_get_data(tlv8_encoder_t codec);
-// Detach data buffer
+// Detach data buffer, NULL while a nested tlv is open
 buffer_t tlv8_encoder_detach_data(tlv8_encoder_t codec);
 // Cleanup
 void tlv8_encoder_free(void *codec);
 
 // Create a new TLV8 codec decoder.
 tlv8_decoder_t tlv8_decoder_new(buffer_t data);
-// Detach data buffer (in case it's in use elsewhere) before free
+// Create a new TLV8 codec decoder using a specific allocator, also used for the decoded tlvs and their data
+tlv8_decoder_t tlv8_decoder_new_with_allocator(buffer_t data, const tlv8_allocator_t *allocator);
+// Create a new TLV8 codec decoder reading data in place. Data is not owned and must outlive the decoder
+tlv8_decoder_t tlv8_decoder_new_with_data(const void *data, int data_len);
+// Same as above using a specific allocator, also used for the decoded tlvs and their data
+tlv8_decoder_t tlv8_decoder_new_with_data_and_allocator(const void *data, int data_len, const tlv8_allocator_t *allocator);
+// Create a new TLV8 codec decoder reading base64 text in place, decoding it on the fly
+tlv8_decoder_t tlv8_decoder_new_base64(const char *text, int text_len);
+// Detach data buffer (in case it's in use elsewhere) before free.
+// Decoded tlvs sharing the buffer get a private copy of it. If the copy can't be
+// made, NULL is returned, the decoder keeps the buffer and tlv8_decoder_get_error
+// returns TLV8_ERR_ALLOC_FAILED
 buffer_t tlv8_decoder_detach_data(tlv8_decoder_t codec);
 // Returns true if there are more tlvs to decode
 int tlv8_decoder_has_next(tlv8_decoder_t codec);
@@ -113,9 +210,94 @@ int tlv8_decoder_has_next(tlv8_decoder_t codec);
 uint8_t tlv8_decoder_peek_type(tlv8_decoder_t codec);
 // Returns a TLV of appropriate type form the next TLV data
 tlv8_t tlv8_decoder_decode(tlv8_decoder_t codec, TLV8_DATA_TYPE type);
+// Returns the last error, TLV8_ERR_OK if the data decoded so far is well formed
+int tlv8_decoder_get_error(tlv8_decoder_t codec);
 // Cleanup
 void tlv8_decoder_free(void *codec);
 
+// TLV8 template methods
+// Create a new empty message template
+tlv8_template_t tlv8_template_new();
+// Append a tlv to the template layout, its encoded length becomes the slot length.
+// Returns the slot index or an error
+int tlv8_template_add(tlv8_template_t tmpl, tlv8_t tlv);
+// Append a zero filled slot of fixed length. Returns the slot index or an error
+int tlv8_template_add_slot(tlv8_template_t tmpl, uint8_t type, int len);
+// Patch the value of a slot, the value must fit in the slot length
+int tlv8_template_set_integer(tlv8_template_t tmpl, int slot, uint64_t integer);
+int tlv8_template_set_data(tlv8_template_t tmpl, int slot, const void *data, int data_len);
+// Encode the template in a new buffer
+buffer_t tlv8_template_encode(tlv8_template_t tmpl);
+// Append the encoded template to an existing buffer
+int tlv8_template_encode_into(tlv8_template_t tmpl, buffer_t buffer);
+// Cleanup
+void tlv8_template_free(void *tmpl);
+
+// TLV8 message methods
+// Create an editable copy of an encoded message. The mapping is only needed
+// to recognize separators and must outlive the message, it may be NULL
+tlv8_message_t tlv8_message_new(buffer_t buffer, const TLV8_DATA_TYPE *mapping);
+// Replace the tlv of the same type, in place when the encoded size is unchanged.
+// Separators are only accepted, and required, for types the mapping marks as separators
+int tlv8_message_replace(tlv8_message_t msg, tlv8_t tlv);
+// Insert a tlv before the tlv of type before_type, or at the end if before_type is negative
+int tlv8_message_insert(tlv8_message_t msg, tlv8_t tlv, int before_type);
+// Remove the tlv of a given type
+int tlv8_message_remove(tlv8_message_t msg, uint8_t type);
+// Encoded message, valid until the next edit
+const unsigned char *tlv8_message_get_data(tlv8_message_t msg);
+int tlv8_message_get_length(tlv8_message_t msg);
+// Copy the encoded message in a new buffer
+buffer_t tlv8_message_encode(tlv8_message_t msg);
+// Cleanup
+void tlv8_message_free(void *msg);
+
+// TLV8 parser methods
+// Call handlers[type] for each tlv of data, in order, tlvs without a callback are skipped.
+// Nothing is allocated, spans point into data. The mapping is only needed to recognize
+// separators, it may be NULL. Returns the first non zero callback result
+int tlv8_parse(const void *data, int data_len, const tlv8_handler_t handlers[256], const TLV8_DATA_TYPE *mapping);
+// Value of an integer tlv
+uint64_t tlv8_parse_integer(const unsigned char *data, int len);
+
+// TLV8 cache methods
+// Create a cache of the encoded form of an array, and of its base64 text if base64 is set.
+// The array belongs to the caller and must outlive the cache
+tlv8_cache_t tlv8_cache_new(array_t array, int base64);
+// Call after each change of the array, the next read encodes it again
+void tlv8_cache_invalidate(tlv8_cache_t cache);
+// Get the current encoded form. The entry is retained under a spinlock held for a few
+// instructions, shared with refreshes swapping it; the mutex is only taken when the
+// array must be encoded again. The entry stays valid until released, whatever happens
+// to the cache
+tlv8_cache_entry_t tlv8_cache_get(tlv8_cache_t cache);
+const unsigned char *tlv8_cache_entry_get_data(tlv8_cache_entry_t entry);
+int tlv8_cache_entry_get_length(tlv8_cache_entry_t entry);
+// NUL terminated base64 text, NULL if the cache was created without base64
+const char *tlv8_cache_entry_get_base64(tlv8_cache_entry_t entry);
+int tlv8_cache_entry_get_base64_length(tlv8_cache_entry_t entry);
+void tlv8_cache_entry_release(tlv8_cache_entry_t entry);
+// Cleanup, no read may be in progress
+void tlv8_cache_free(void *cache);
+
+// TLV8 ring methods
+// Single producer, single consumer ring of encoded messages. Size is a power of 2,
+// each message takes 4 more bytes
+tlv8_ring_t tlv8_ring_new(int size);
+// Producer: reserve room for a message of up to max_len bytes, a pending reservation is abandoned
+int tlv8_ring_reserve(tlv8_ring_t ring, int max_len);
+// Producer: sink writing in the reserved room, use with tlv8_encoder_new_with_sink(tlv8_ring_sink, ring)
+int tlv8_ring_sink(void *ring, const void *data, int len);
+// Producer: make the message written since tlv8_ring_reserve available to the consumer
+int tlv8_ring_publish(tlv8_ring_t ring);
+// Consumer: get the oldest message in place, in 1 or 2 spans if it wraps around.
+// Returns the number of spans, 0 if the ring is empty
+int tlv8_ring_peek(tlv8_ring_t ring, tlv8_span_t spans[2]);
+// Consumer: give the room of the peeked message back to the producer
+void tlv8_ring_release(tlv8_ring_t ring);
+// Cleanup
+void tlv8_ring_free(void *ring);
+
 // Convenience methods
 // Deprecated, use tlv8_encode_array
 buffer_t tlv8_encode(const array_t array);
@@ -124,6 +306,13 @@ buffer_t tlv8_encode_array(const array_t array);
 // Encode tlvs as a list (will free tlvs after encoding)
 buffer_t tlv8_encode_list(int count, ...);
 array_t tlv8_decode(const buffer_t buffer, const TLV8_DATA_TYPE *mapping);
+// Decode using a specific allocator for the tlvs and their data
+array_t tlv8_decode_with_allocator(const buffer_t buffer, const TLV8_DATA_TYPE *mapping, const tlv8_allocator_t *allocator);
+// Decode count buffers spreading the work over num_workers tasks (including the caller).
+// results[i] receives the decoded array of buffers[i]
+// If not NULL, allocators holds one allocator per worker (e.g. one pool each), it must
+// outlive the results. Otherwise the current allocator is shared by all workers
+int tlv8_decode_batch(const buffer_t *buffers, int count, const TLV8_DATA_TYPE *mapping, array_t *results, int num_workers, const tlv8_allocator_t *const *allocators);
 tlv8_t tlv8_tlv_of_type(array_t tlvs, uint8_t type);
 
 #endif // _TLV8_H
@@ -0,0 +1,83 @@
+/*
+ * A TLV8 utility for esp32.
+ *
+ * Copyright (c) 2017 Emmanuel Merali
+ * https://github.com/ifullgaz/esp32-tlv8
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef _TLV8_CAPTURE_H
+#define _TLV8_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "esp_partition.h"
+#include "esp32-tlv8/tlv8.h"
+
+typedef enum {
+    TLV8_CAPTURE_DIRECTION_IN,
+    TLV8_CAPTURE_DIRECTION_OUT
+} TLV8_CAPTURE_DIRECTION;
+
+typedef struct {
+    uint64_t                timestamp;
+    TLV8_CAPTURE_DIRECTION  direction;
+    const unsigned char     *data;
+    int                     len;
+} tlv8_capture_record_t;
+
+typedef struct _tlv8_capture_writer *tlv8_capture_writer_t;
+typedef struct _tlv8_capture_reader *tlv8_capture_reader_t;
+
+// TLV8 capture methods
+// Capture layout, all integers little endian:
+//   header:  "TLV8" | version (2) | reserved (2) | index offset (4) | record count (4)
+//   record:  timestamp (8) | direction (1) | reserved (3) | length (4) | data
+//   index:   record offset (4) * record count
+// Create a capture writer appending to an open, seekable file. The file is not closed by the writer
+tlv8_capture_writer_t tlv8_capture_writer_new(FILE *file);
+// Append a message record
+int tlv8_capture_writer_write(tlv8_capture_writer_t writer, uint64_t timestamp, TLV8_CAPTURE_DIRECTION direction, const void *data, int data_len);
+// Write the index, complete the header and free the writer
+int tlv8_capture_writer_close(tlv8_capture_writer_t writer);
+// Create a capture reader over a capture in memory. Data is not copied and must outlive the reader
+tlv8_capture_reader_t tlv8_capture_reader_new(const void *data, size_t data_len);
+// Create a capture reader over a capture stored in a flash partition, the partition is memory mapped
+tlv8_capture_reader_t tlv8_capture_reader_new_with_partition(const esp_partition_t *partition);
+// Number of records in the capture
+int tlv8_capture_reader_count(tlv8_capture_reader_t reader);
+// Get a record, the record data points into the capture
+int tlv8_capture_reader_get(tlv8_capture_reader_t reader, int index, tlv8_capture_record_t *record);
+// Create a decoder reading the record data in place
+tlv8_decoder_t tlv8_capture_reader_decoder(tlv8_capture_reader_t reader, int index);
+// Cleanup
+void tlv8_capture_reader_free(void *reader);
+
+#endif // _TLV8_CAPTURE_H
+#ifdef __cplusplus
+}
+#endif
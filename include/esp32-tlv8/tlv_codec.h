@@ -0,0 +1,329 @@
+/*
+ * A TLV8 utility for esp32.
+ *
+ * Copyright (c) 2017 Emmanuel Merali
+ * https://github.com/ifullgaz/esp32-tlv8
+ *
+ * The MIT License (MIT)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is furnished to do
+ * so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef _TLV_CODEC_H
+#define _TLV_CODEC_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Wire level TLV codec generated for a given type width, length encoding and
+// fragment policy. Every function is static inline with constant widths so an
+// instance compiles to code as tight as a hand written parser.
+//
+//   TLV_CODEC_DEFINE(name, type_bytes, len_codec, fragment_len)
+//     type_bytes:   1 or 2, big endian
+//     len_codec:    u8, u16be, u16le or ber
+//     fragment_len: values longer than this are split in consecutive items of
+//                   the same type, 0 for no fragmentation
+//
+// Generated functions:
+//   name_header_size(len)                  Size of a header for a value of len bytes
+//   name_encoded_size(len)                 Size of an encoded value, all fragments included
+//   name_write_header(out, type, len)      Write a header, returns its size
+//   name_read_header(in, avail, &type, &len)
+//                                          Read a header, returns its size or an error
+//   name_write(out, type, data, len)       Write a value, zero filled if data is NULL.
+//                                          Returns the encoded size or an error
+//   name_next(data, len, pos, &item)       Read the item at pos, joining its fragments.
+//                                          Returns the position of the next item or an error
+//   name_item_copy(&item, out)             Copy the value of an item, fragments joined
+
+// Kept clear of the TLV8_ERR_* range
+#define TLV_CODEC_ERR_TRUNCATED         -0x0100
+#define TLV_CODEC_ERR_TOO_LONG          -0x0102
+
+/***********************************************************************************************************
+ * Type fields
+ ***********************************************************************************************************/
+static inline void tlv_type1_write(unsigned char *out, uint32_t type) {
+    out[0] = (unsigned char)type;
+}
+
+static inline uint32_t tlv_type1_read(const unsigned char *in) {
+    return in[0];
+}
+
+static inline void tlv_type2_write(unsigned char *out, uint32_t type) {
+    out[0] = (unsigned char)(type >> 8);
+    out[1] = (unsigned char)type;
+}
+
+static inline uint32_t tlv_type2_read(const unsigned char *in) {
+    return ((uint32_t)in[0] << 8) | in[1];
+}
+
+/***********************************************************************************************************
+ * Length fields
+ ***********************************************************************************************************/
+#define TLV_LEN_BER_MAX                 0x7FFFFFFF
+
+static inline uint32_t tlv_len_u8_max() {
+    return 0xFF;
+}
+
+static inline int tlv_len_u8_size(uint32_t len) {
+    return 1;
+}
+
+static inline int tlv_len_u8_write(unsigned char *out, uint32_t len) {
+    out[0] = (unsigned char)len;
+    return 1;
+}
+
+static inline int tlv_len_u8_read(const unsigned char *in, int avail, uint32_t *len) {
+    if (avail < 1) {
+        return TLV_CODEC_ERR_TRUNCATED;
+    }
+    *len = in[0];
+    return 1;
+}
+
+static inline uint32_t tlv_len_u16be_max() {
+    return 0xFFFF;
+}
+
+static inline int tlv_len_u16be_size(uint32_t len) {
+    return 2;
+}
+
+static inline int tlv_len_u16be_write(unsigned char *out, uint32_t len) {
+    out[0] = (unsigned char)(len >> 8);
+    out[1] = (unsigned char)len;
+    return 2;
+}
+
+static inline int tlv_len_u16be_read(const unsigned char *in, int avail, uint32_t *len) {
+    if (avail < 2) {
+        return TLV_CODEC_ERR_TRUNCATED;
+    }
+    *len = ((uint32_t)in[0] << 8) | in[1];
+    return 2;
+}
+
+static inline uint32_t tlv_len_u16le_max() {
+    return 0xFFFF;
+}
+
+static inline int tlv_len_u16le_size(uint32_t len) {
+    return 2;
+}
+
+static inline int tlv_len_u16le_write(unsigned char *out, uint32_t len) {
+    out[0] = (unsigned char)len;
+    out[1] = (unsigned char)(len >> 8);
+    return 2;
+}
+
+static inline int tlv_len_u16le_read(const unsigned char *in, int avail, uint32_t *len) {
+    if (avail < 2) {
+        return TLV_CODEC_ERR_TRUNCATED;
+    }
+    *len = ((uint32_t)in[1] << 8) | in[0];
+    return 2;
+}
+
+// BER definite length: short form below 128, else 0x80 | count followed by count big endian bytes
+static inline uint32_t tlv_len_ber_max() {
+    return TLV_LEN_BER_MAX;
+}
+
+static inline int tlv_len_ber_size(uint32_t len) {
+    if (len < 0x80) {
+        return 1;
+    }
+    int size = 2;
+    while (len >>= 8) {
+        size++;
+    }
+    return size;
+}
+
+static inline int tlv_len_ber_write(unsigned char *out, uint32_t len) {
+    if (len < 0x80) {
+        out[0] = (unsigned char)len;
+        return 1;
+    }
+    int size = tlv_len_ber_size(len);
+    out[0] = 0x80 | (size - 1);
+    for (int i = size - 1; i > 0; i--) {
+        out[i] = (unsigned char)len;
+        len = len >> 8;
+    }
+    return size;
+}
+
+static inline int tlv_len_ber_read(const unsigned char *in, int avail, uint32_t *len) {
+    if (avail < 1) {
+        return TLV_CODEC_ERR_TRUNCATED;
+    }
+    if (in[0] < 0x80) {
+        *len = in[0];
+        return 1;
+    }
+    int count = in[0] & 0x7F;
+    if (count == 0 || count > 4) {
+        return TLV_CODEC_ERR_TOO_LONG;
+    }
+    if (avail < count + 1) {
+        return TLV_CODEC_ERR_TRUNCATED;
+    }
+    uint32_t value = 0;
+    for (int i = 1; i <= count; i++) {
+        value = (value << 8) | in[i];
+    }
+    if (value > TLV_LEN_BER_MAX) {
+        return TLV_CODEC_ERR_TOO_LONG;
+    }
+    *len = value;
+    return count + 1;
+}
+
+/***********************************************************************************************************
+ * Codec
+ ***********************************************************************************************************/
+#define TLV_CODEC_DEFINE(name, type_bytes, len_codec, fragment_len) \
+typedef struct { \
+    uint32_t type; \
+    /* Value length, fragments joined */ \
+    uint32_t len; \
+    int num_fragments; \
+    /* First header and total encoded size */ \
+    const unsigned char *start; \
+    int size; \
+} name##_item_t; \
+\
+static inline int name##_header_size(uint32_t len) { \
+    return type_bytes + tlv_len_##len_codec##_size(len); \
+} \
+\
+static inline int name##_encoded_size(uint32_t len) { \
+    if (!(fragment_len) || len <= (uint32_t)(fragment_len)) { \
+        return name##_header_size(len) + len; \
+    } \
+    /* Never 0 here, keeps the compiler from seeing a division by zero */ \
+    const uint32_t fragment = (fragment_len) ? (uint32_t)(fragment_len) : 1; \
+    uint32_t full = (len - 1) / fragment; \
+    uint32_t last = len - full * fragment; \
+    return full * (name##_header_size(fragment) + fragment) + name##_header_size(last) + last; \
+} \
+\
+static inline int name##_write_header(unsigned char *out, uint32_t type, uint32_t len) { \
+    tlv_type##type_bytes##_write(out, type); \
+    return type_bytes + tlv_len_##len_codec##_write(out + type_bytes, len); \
+} \
+\
+static inline int name##_read_header(const unsigned char *in, int avail, uint32_t *type, uint32_t *len) { \
+    if (avail < type_bytes) { \
+        return TLV_CODEC_ERR_TRUNCATED; \
+    } \
+    *type = tlv_type##type_bytes##_read(in); \
+    int size = tlv_len_##len_codec##_read(in + type_bytes, avail - type_bytes, len); \
+    if (size < 0) { \
+        return size; \
+    } \
+    return type_bytes + size; \
+} \
+\
+static inline int name##_write(unsigned char *out, uint32_t type, const unsigned char *data, uint32_t len) { \
+    uint32_t max_len = (fragment_len) ? (uint32_t)(fragment_len) : tlv_len_##len_codec##_max(); \
+    if (!(fragment_len) && len > max_len) { \
+        return TLV_CODEC_ERR_TOO_LONG; \
+    } \
+    int pos = 0; \
+    do { \
+        uint32_t size = len < max_len ? len : max_len; \
+        pos+= name##_write_header(out + pos, type, size); \
+        if (data) { \
+            memcpy(out + pos, data, size); \
+            data+= size; \
+        } \
+        else { \
+            memset(out + pos, 0, size); \
+        } \
+        pos+= size; \
+        len-= size; \
+    } while (len > 0); \
+    return pos; \
+} \
+\
+static inline int name##_next(const unsigned char *data, int len, int pos, name##_item_t *item) { \
+    uint32_t type, size; \
+    int header = name##_read_header(data + pos, len - pos, &item->type, &item->len); \
+    if (header < 0) { \
+        return header; \
+    } \
+    if (item->len > (uint32_t)(len - pos - header)) { \
+        return TLV_CODEC_ERR_TRUNCATED; \
+    } \
+    item->start = data + pos; \
+    item->num_fragments = 1; \
+    pos+= header + item->len; \
+    /* Consecutive items of the same type are fragments of the same value */ \
+    while ((fragment_len) && pos < len) { \
+        header = name##_read_header(data + pos, len - pos, &type, &size); \
+        if (header < 0 || type != item->type) { \
+            break; \
+        } \
+        if (size > (uint32_t)(len - pos - header)) { \
+            return TLV_CODEC_ERR_TRUNCATED; \
+        } \
+        item->len+= size; \
+        item->num_fragments++; \
+        pos+= header + size; \
+    } \
+    item->size = pos - (int)(item->start - data); \
+    return pos; \
+} \
+\
+static inline void name##_item_copy(const name##_item_t *item, unsigned char *out) { \
+    const unsigned char *in = item->start; \
+    for (int i = 0; i < item->num_fragments; i++) { \
+        uint32_t type, size; \
+        in+= name##_read_header(in, item->size - (int)(in - item->start), &type, &size); \
+        memcpy(out, in, size); \
+        out+= size; \
+        in+= size; \
+    } \
+}
+
+// TLV8: 8 bit type, 8 bit length, values split in 255 bytes fragments
+TLV_CODEC_DEFINE(tlv_wire8, 1, u8, 255)
+// 8 bit type, 16 bit big endian length, no fragmentation
+TLV_CODEC_DEFINE(tlv_wire16, 1, u16be, 0)
+// 8 bit tag, BER definite length, no fragmentation
+TLV_CODEC_DEFINE(tlv_wire_ber, 1, ber, 0)
+
+#endif // _TLV_CODEC_H
+#ifdef __cplusplus
+}
+#endif
@@ -28,11 +28,14 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "mbedtls/bignum.h"
 #include "esp32-tlv8/tlv8.h"
+#include "esp32-tlv8/tlv8_capture.h"
+#include "esp32-tlv8/tlv_codec.h"
 
-static const uint8_t data_types[] = {
+static const TLV8_DATA_TYPE data_types[] = {
     0,
     TLV8_DATA_TYPE_INTEGER,
     TLV8_DATA_TYPE_INTEGER,
@@ -56,6 +59,22 @@ static void dump_codec(tlv8_encoder_t codec, const char *description) {
     dump_buffer(buffer, description);
 }
 
+static void dump_spans(const tlv8_span_t *spans, int num_spans, const char *description) {
+    printf("%s, %d span(s)\n", description, num_spans);
+    for (int i = 0; i < num_spans; i++) {
+        dump_data(spans[i].data, spans[i].len, NULL);
+    }
+}
+
+static int print_parsed(void *ctx, uint8_t type, const unsigned char *data, int len, const tlv8_span_t *spans, int num_spans) {
+    printf("Parsed, Type: %d, len: %d, in place: %s, fragments:", type, len, data ? "yes" : "no");
+    for (int i = 0; i < num_spans; i++) {
+        printf(" %d", spans[i].len);
+    }
+    printf("\n");
+    return 0;
+}
+
 static const char *big_number_string =
 "FFFFFFFFFFFFFFFFC90FDAA22168C234C4C6628B80DC1CD129024E08"
 "8A67CC74020BBEA63B139B22514A08798E3404DDEF9519B3CD3A431B"
@@ -147,17 +166,16 @@ void app_main() {
     dump_codec(codec, "TLV 8");
     tlv8_encoder_free(codec);
 
+    // TLV 10 is encoded straight into the value of TLV 9
     tlv2 = tlv8_new_with_string(10, "Hello");
     codec = tlv8_encoder_new(NULL);
+    tlv8_encoder_begin_nested(codec, 9);
+    tlv8_encoder_begin_nested(full_codec, 9);
     tlv8_encoder_encode(codec, tlv2);
-    dump_codec(codec, "TLV 10");
-    tlv1 = tlv8_new_with_buffer(9, tlv8_encoder_get_data(codec));
-    tlv8_encoder_free(codec);
+    tlv8_encoder_encode(full_codec, tlv2);
+    tlv8_encoder_end_nested(codec);
+    tlv8_encoder_end_nested(full_codec);
     tlv8_free(tlv2);
-    codec = tlv8_encoder_new(NULL);
-    tlv8_encoder_encode(codec, tlv1);
-    tlv8_encoder_encode(full_codec, tlv1);
-    tlv8_free(tlv1);
     dump_codec(codec, "TLV 9");
     tlv8_encoder_free(codec);
 
@@ -220,6 +238,8 @@ void app_main() {
                         tlv8_t inner_tlv = tlv8_decoder_decode(inner_decoder, inner_data_type);
                         printf("Inner string, Type: %d, value: %s\n", inner_type, tlv8_get_string_value(inner_tlv));
                         tlv8_free(inner_tlv);
+                        // The buffer belongs to tlv
+                        tlv8_decoder_detach_data(inner_decoder);
                         tlv8_decoder_free(inner_decoder);
                     }
                     break;
@@ -233,6 +253,8 @@ void app_main() {
         }
         tlv8_free(tlv);
     }
+    // The buffer belongs to full_codec
+    tlv8_decoder_detach_data(decoder);
     tlv8_decoder_free(decoder);
 
     array_t array = tlv8_decode(tlv8_encoder_get_data(full_codec), data_types);
@@ -270,4 +292,205 @@ void app_main() {
         }
     }
     array_free(array);
+
+    // Precompiled template: State + fixed length PublicKey, only values are patched
+    uint8_t public_key[32];
+    memset(public_key, 0xAB, sizeof(public_key));
+    tlv8_template_t template = tlv8_template_new();
+    int state_slot = tlv8_template_add_slot(template, 6, 1);
+    int key_slot = tlv8_template_add_slot(template, 3, sizeof(public_key));
+    tlv8_template_set_integer(template, state_slot, 2);
+    tlv8_template_set_data(template, key_slot, public_key, sizeof(public_key));
+    buffer_t message = tlv8_template_encode(template);
+    dump_buffer(message, "Template State + PublicKey");
+    buffer_free(message);
+    tlv8_template_free(template);
+
+    // Same wire codec with a 16 bit length and a BER length, 300 bytes fit in a single item
+    unsigned char value[300], wire[sizeof(value) + 4], copy[sizeof(value)];
+    for (int i = 0; i < sizeof(value); i++) {
+        value[i] = i;
+    }
+    tlv_wire16_item_t item16;
+    int len16 = tlv_wire16_write(wire, 0x42, value, sizeof(value));
+    dump_data(wire, 8, "Wire16 header + start of value");
+    tlv_wire16_next(wire, len16, 0, &item16);
+    tlv_wire16_item_copy(&item16, copy);
+    printf("Wire16, Type: %d, len: %d, size: %d, round trip: %s\n", item16.type, item16.len, len16, memcmp(copy, value, sizeof(value)) ? "failed" : "ok");
+    tlv_wire_ber_item_t item_ber;
+    int len_ber = tlv_wire_ber_write(wire, 0x30, value, sizeof(value));
+    dump_data(wire, 8, "BER header + start of value");
+    tlv_wire_ber_next(wire, len_ber, 0, &item_ber);
+    tlv_wire_ber_item_copy(&item_ber, copy);
+    printf("BER, Type: %d, len: %d, size: %d, round trip: %s\n", item_ber.type, item_ber.len, len_ber, memcmp(copy, value, sizeof(value)) ? "failed" : "ok");
+    // Length bytes missing
+    printf("BER truncated header: %d\n", tlv_wire_ber_next(wire, 3, 0, &item_ber));
+
+    // Ring of 64 bytes, the third 18 bytes message wraps around the end
+    tlv8_ring_t ring = tlv8_ring_new(64);
+    codec = tlv8_encoder_new_with_sink(tlv8_ring_sink, ring);
+    for (int i = 0; i < 3; i++) {
+        tlv8_span_t spans[2];
+        tlv1 = tlv8_new_with_string(7, "Ring message ...");
+        tlv8_ring_reserve(ring, 20);
+        tlv8_encoder_encode(codec, tlv1);
+        tlv8_ring_publish(ring);
+        tlv8_encoder_reset(codec);
+        tlv8_free(tlv1);
+        int num_spans = tlv8_ring_peek(ring, spans);
+        dump_spans(spans, num_spans, "Ring message");
+        tlv8_ring_release(ring);
+    }
+    tlv8_encoder_free(codec);
+    tlv8_ring_free(ring);
+
+    // Base64 text written and decoded on the fly
+    codec = tlv8_encoder_new_base64(NULL);
+    tlv1 = tlv8_new_with_integer(6, 2);
+    tlv8_encoder_encode(codec, tlv1);
+    tlv8_free(tlv1);
+    tlv1 = tlv8_new_with_string(7, "Hello");
+    tlv8_encoder_encode(codec, tlv1);
+    tlv8_free(tlv1);
+    tlv8_encoder_finish(codec);
+    buffer_t text = tlv8_encoder_get_data(codec);
+    printf("Base64: %.*s\n", buffer_get_length(text), (const char *)buffer_get_data(text));
+    decoder = tlv8_decoder_new_base64((const char *)buffer_get_data(text), buffer_get_length(text));
+    while (tlv8_decoder_has_next(decoder)) {
+        uint8_t type = tlv8_decoder_peek_type(decoder);
+        tlv8_t tlv = tlv8_decoder_decode(decoder, data_types[type]);
+        if (data_types[type] == TLV8_DATA_TYPE_INTEGER) {
+            printf("Base64 integer, Type: %d, value: %4llx\n", type, tlv8_get_integer_value(tlv));
+        }
+        else {
+            printf("Base64 string, Type: %d, value: %s\n", type, tlv8_get_string_value(tlv));
+        }
+        tlv8_free(tlv);
+    }
+    tlv8_decoder_free(decoder);
+    tlv8_encoder_free(codec);
+    // Padding is only allowed at the end of the last group
+    decoder = tlv8_decoder_new_base64("Bg=BAg==", 8);
+    tlv8_decoder_peek_type(decoder);
+    tlv1 = tlv8_decoder_decode(decoder, TLV8_DATA_TYPE_INTEGER);
+    printf("Malformed base64, tlv: %s, error: %d\n", tlv1 ? "decoded" : "none", tlv8_decoder_get_error(decoder));
+    tlv8_free(tlv1);
+    tlv8_decoder_free(decoder);
+
+    // Parse in place, a 600 bytes value comes in 3 fragments
+    unsigned char long_value[600];
+    memset(long_value, 0x5A, sizeof(long_value));
+    message = tlv8_encode_list(2, tlv8_new_with_integer(6, 3), tlv8_new_with_data(9, long_value, sizeof(long_value)));
+    tlv8_handler_t handlers[256] = { 0 };
+    handlers[6].callback = print_parsed;
+    handlers[9].callback = print_parsed;
+    tlv8_parse(buffer_get_data(message), buffer_get_length(message), handlers, NULL);
+    buffer_free(message);
+
+    // Edit an encoded message without decoding it
+    message = tlv8_encode_list(3, tlv8_new_with_integer(6, 1), tlv8_new_with_data(3, public_key, 4), tlv8_new_with_string(7, "Hello"));
+    tlv8_message_t edit = tlv8_message_new(message, NULL);
+    buffer_free(message);
+    dump_data(tlv8_message_get_data(edit), tlv8_message_get_length(edit), "Message");
+    tlv1 = tlv8_new_with_integer(6, 2);
+    tlv8_message_replace(edit, tlv1);
+    tlv8_free(tlv1);
+    dump_data(tlv8_message_get_data(edit), tlv8_message_get_length(edit), "Message, State replaced");
+    tlv1 = tlv8_new_with_integer(1, 0xFF);
+    tlv8_message_insert(edit, tlv1, 3);
+    tlv8_free(tlv1);
+    dump_data(tlv8_message_get_data(edit), tlv8_message_get_length(edit), "Message, TLV 1 inserted before TLV 3");
+    tlv8_message_remove(edit, 7);
+    dump_data(tlv8_message_get_data(edit), tlv8_message_get_length(edit), "Message, TLV 7 removed");
+    tlv8_message_free(edit);
+
+    // Capture two messages in memory, then replay them
+    static unsigned char capture[256];
+    FILE *file = fmemopen(capture, sizeof(capture), "w+");
+    tlv8_capture_writer_t writer = tlv8_capture_writer_new(file);
+    for (int i = 0; i < 2; i++) {
+        message = tlv8_encode_list(1, tlv8_new_with_integer(6, i + 1));
+        tlv8_capture_writer_write(writer, 1000 + i, i ? TLV8_CAPTURE_DIRECTION_OUT : TLV8_CAPTURE_DIRECTION_IN, buffer_get_data(message), buffer_get_length(message));
+        buffer_free(message);
+    }
+    tlv8_capture_writer_close(writer);
+    fseek(file, 0, SEEK_END);
+    long capture_len = ftell(file);
+    fclose(file);
+    tlv8_capture_reader_t reader = tlv8_capture_reader_new(capture, capture_len);
+    for (int i = 0; i < tlv8_capture_reader_count(reader); i++) {
+        tlv8_capture_record_t record;
+        tlv8_capture_reader_get(reader, i, &record);
+        decoder = tlv8_capture_reader_decoder(reader, i);
+        tlv8_decoder_peek_type(decoder);
+        tlv1 = tlv8_decoder_decode(decoder, TLV8_DATA_TYPE_INTEGER);
+        printf("Replayed, timestamp: %llu, direction: %s, State: %llu\n", record.timestamp, record.direction == TLV8_CAPTURE_DIRECTION_IN ? "in" : "out", tlv8_get_integer_value(tlv1));
+        tlv8_free(tlv1);
+        tlv8_decoder_free(decoder);
+    }
+    tlv8_capture_reader_free(reader);
+
+    // A decoded value slices the decoder buffer and keeps it alive after the decoder is gone
+    decoder = tlv8_decoder_new(tlv8_encode_list(1, tlv8_new_with_string(7, "Sliced")));
+    tlv8_decoder_peek_type(decoder);
+    tlv1 = tlv8_decoder_decode(decoder, TLV8_DATA_TYPE_BYTES);
+    tlv8_decoder_free(decoder);
+    printf("Slice after decoder free, value: %.*s\n", tlv8_get_length(tlv1), (const char *)tlv8_get_bytes_value(tlv1));
+    tlv8_free(tlv1);
+
+    // Decode a batch of messages on 2 workers, each allocating from its own pool
+    buffer_t batch[4];
+    array_t results[4];
+    for (int i = 0; i < 4; i++) {
+        batch[i] = tlv8_encode_list(2, tlv8_new_with_integer(6, i + 1), tlv8_new_with_string(7, "Batch"));
+    }
+    tlv8_pool_t pools[2] = {
+        tlv8_pool_new(NULL, 64, 16, &tlv8_allocator_default),
+        tlv8_pool_new(NULL, 64, 16, &tlv8_allocator_default)
+    };
+    const tlv8_allocator_t *allocators[2] = { tlv8_pool_get_allocator(pools[0]), tlv8_pool_get_allocator(pools[1]) };
+    int err = tlv8_decode_batch(batch, 4, data_types, results, 2, allocators);
+    printf("Batch decoded, result: %d\n", err);
+    for (int i = 0; i < 4; i++) {
+        if (!err) {
+            printf("Batch %d, State: %llu, value: %s\n", i, tlv8_get_integer_value(tlv8_tlv_of_type(results[i], 6)), tlv8_get_string_value(tlv8_tlv_of_type(results[i], 7)));
+            array_free(results[i]);
+        }
+        buffer_free(batch[i]);
+    }
+    // The pools must outlive the results
+    tlv8_pool_free(pools[0]);
+    tlv8_pool_free(pools[1]);
+
+    // Build tlvs from a pool in static storage, values larger than a block go to PSRAM
+    static uint64_t storage[8 * 8];
+    tlv8_pool_t pool = tlv8_pool_new(storage, 64, 8, &tlv8_allocator_spiram);
+    tlv8_set_allocator(tlv8_pool_get_allocator(pool));
+    message = tlv8_encode_list(2, tlv8_new_with_integer(6, 5), tlv8_new_with_data(9, long_value, 100));
+    dump_buffer(message, "Pooled TLVs");
+    buffer_free(message);
+    // Or put everything in PSRAM
+    tlv8_set_allocator(&tlv8_allocator_spiram);
+    tlv1 = tlv8_new_with_string(7, "PSRAM");
+    printf("Allocated in PSRAM, value: %s\n", tlv8_get_string_value(tlv1));
+    tlv8_free(tlv1);
+    tlv8_set_allocator(NULL);
+    tlv8_pool_free(pool);
+
+    // Serve the encoded form of an array, encoded again only after it changed
+    array_t state = array_new(tlv8_free);
+    array_push(state, tlv8_new_with_integer(6, 1));
+    tlv8_cache_t cache = tlv8_cache_new(state, 1);
+    tlv8_cache_entry_t entry = tlv8_cache_get(cache);
+    dump_data(tlv8_cache_entry_get_data(entry), tlv8_cache_entry_get_length(entry), "Cached");
+    printf("Cached base64: %s\n", tlv8_cache_entry_get_base64(entry));
+    array_push(state, tlv8_new_with_string(7, "Hello"));
+    tlv8_cache_invalidate(cache);
+    // The old entry stays valid until released
+    tlv8_cache_entry_t updated = tlv8_cache_get(cache);
+    printf("Cached base64: %s, updated: %s\n", tlv8_cache_entry_get_base64(entry), tlv8_cache_entry_get_base64(updated));
+    tlv8_cache_entry_release(entry);
+    tlv8_cache_entry_release(updated);
+    tlv8_cache_free(cache);
+    array_free(state);
 }
@@ -30,18 +30,50 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
-#include <math.h>
 #include "esp32-tlv8/tlv8.h"
+#include "esp32-tlv8/tlv8_capture.h"
+#include "esp32-tlv8/tlv_codec.h"
 #include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
 
 static const char *TAG = "ESP32-TLV8";
 
 #define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
 #define TLV8_MAX_DATA_LEN       255
 
+#define TLV8_BASE64_CHUNK_LEN   64
+
+#define TLV8_RING_HEADER_LEN    4
+
+#define TLV8_CAPTURE_MAGIC              "TLV8"
+#define TLV8_CAPTURE_VERSION            1
+#define TLV8_CAPTURE_HEADER_LEN         16
+#define TLV8_CAPTURE_RECORD_HEADER_LEN  16
+
+#ifndef TLV8_BATCH_STACK_SIZE
+#define TLV8_BATCH_STACK_SIZE   4096
+#endif
+
+// Decoder buffer shared by the decoder and the tlvs slicing it
+typedef struct _tlv8_source {
+    int                     refs;
+    const tlv8_allocator_t  *allocator;
+    buffer_t                buffer;
+    // Data owned by the source when there is no buffer
+    unsigned char           *bytes;
+} *tlv8_source_t;
+
 struct _tlv8 {
     uint8_t             type;
     uint32_t            len;
+    const tlv8_allocator_t *allocator;
+    // When set, the data value is a slice of the source, materialized on demand
+    tlv8_source_t       source;
+    int                 offset;
     struct {
         TLV8_DATA_TYPE  type;
         union {
@@ -55,16 +87,323 @@ struct _tlv8 {
 struct _tlv8_encoder {
     uint8_t type;
     buffer_t data;
+    const tlv8_allocator_t *allocator;
+    // Base64 output, to data or to the sink, with up to 2 bytes waiting for a full group
+    int base64;
+    tlv8_sink_t sink;
+    void *sink_ctx;
+    int sink_error;
+    unsigned char pending[3];
+    int num_pending;
+    // Set when no tlv was encoded yet in the innermost nested tlv, or at all by a base64 encoder
+    int nested_empty;
+    int depth;
+    struct {
+        uint8_t type;
+        int offset;
+    } nested[TLV8_MAX_NESTING_DEPTH];
 };
 
 struct _tlv8_decoder {
     uint8_t type;
     buffer_t buffer;
+    const tlv8_allocator_t *allocator;
+    tlv8_source_t source;
+    // Base64 input, data is the text and groups are decoded on access
+    int base64;
+    int num_groups;
+    int group;
+    unsigned char group_data[3];
+    // Last error, decoding stops on malformed data
+    int error;
     int len;
     int pos;
     const unsigned char *data;
 };
 
+struct _tlv8_message {
+    const tlv8_allocator_t *allocator;
+    const TLV8_DATA_TYPE *mapping;
+    unsigned char *data;
+    int len;
+    int capacity;
+};
+
+// Location of an encoded tlv in a message
+typedef struct {
+    int offset;
+    int size;
+    int prev_type;
+    int next_type;
+} tlv8_message_item_t;
+
+struct _tlv8_capture_writer {
+    const tlv8_allocator_t *allocator;
+    FILE *file;
+    long start;
+    uint32_t pos;
+    uint32_t *index;
+    int count;
+    int capacity;
+};
+
+struct _tlv8_capture_reader {
+    const tlv8_allocator_t *allocator;
+    const unsigned char *data;
+    size_t len;
+    uint32_t count;
+    const unsigned char *index;
+    spi_flash_mmap_handle_t handle;
+    int mapped;
+};
+
+// Immutable encoded form of a cached array at a given version
+struct _tlv8_cache_entry {
+    int refs;
+    uint32_t version;
+    const tlv8_allocator_t *allocator;
+    buffer_t data;
+    int base64_len;
+    // NULL unless the cache keeps base64 text
+    char *base64;
+};
+
+// Readers retain the entry under entry_lock, a refresh swaps it under entry_lock too
+// so that a replaced entry can be released as soon as the swap is done. lock only
+// serializes encoding
+struct _tlv8_cache {
+    const tlv8_allocator_t *allocator;
+    array_t array;
+    int base64;
+    uint32_t version;
+    tlv8_cache_entry_t entry;
+    portMUX_TYPE entry_lock;
+    SemaphoreHandle_t lock;
+};
+
+// Positions only grow, masked to index data. head and tail are each written by one side only
+struct _tlv8_ring {
+    const tlv8_allocator_t *allocator;
+    uint32_t mask;
+    // Published end, written by the producer
+    uint32_t head;
+    // Released start, written by the consumer
+    uint32_t tail;
+    // Producer reservation
+    int reserved;
+    uint32_t write;
+    uint32_t limit;
+    // End of the message peeked by the consumer
+    uint32_t next;
+    unsigned char *data;
+};
+
+// Free blocks are linked through their first word
+struct _tlv8_pool {
+    tlv8_allocator_t allocator;
+    const tlv8_allocator_t *owner;
+    const tlv8_allocator_t *fallback;
+    portMUX_TYPE lock;
+    // Storage allocated with the pool, NULL when given by the caller
+    void *storage;
+    unsigned char *start;
+    unsigned char *end;
+    size_t block_size;
+    void *free_list;
+};
+
+typedef struct {
+    const buffer_t *buffers;
+    int count;
+    const TLV8_DATA_TYPE *mapping;
+    array_t *results;
+    const tlv8_allocator_t *const *allocators;
+    int next;
+    int workers;
+    SemaphoreHandle_t done;
+} tlv8_batch_t;
+
+struct _tlv8_template {
+    const tlv8_allocator_t *allocator;
+    unsigned char *data;
+    int len;
+    int capacity;
+    uint8_t type;
+    int count;
+    struct {
+        uint8_t type;
+        int offset;
+        int len;
+    } slots[TLV8_TEMPLATE_MAX_SLOTS];
+};
+
+/***********************************************************************************************************
+ * Allocators
+ ***********************************************************************************************************
+ * Private interface
+ ***********************************************************************************************************/
+static void *tlv8_default_alloc(void *ctx, size_t size) {
+    return malloc(size);
+}
+
+static void tlv8_default_release(void *ctx, void *ptr) {
+    free(ptr);
+}
+
+static void *tlv8_heap_caps_alloc(void *ctx, size_t size) {
+    return heap_caps_malloc(size, (uint32_t)(uintptr_t)ctx);
+}
+
+static void tlv8_heap_caps_release(void *ctx, void *ptr) {
+    heap_caps_free(ptr);
+}
+
+static void *tlv8_pool_alloc(void *ctx, size_t size) {
+    tlv8_pool_t pool = (tlv8_pool_t)ctx;
+    void *block = NULL;
+    if (size <= pool->block_size) {
+        portENTER_CRITICAL(&pool->lock);
+        block = pool->free_list;
+        if (block) {
+            pool->free_list = *(void **)block;
+        }
+        portEXIT_CRITICAL(&pool->lock);
+    }
+    if (!block && pool->fallback) {
+        block = pool->fallback->alloc(pool->fallback->ctx, size);
+    }
+    return block;
+}
+
+static void tlv8_pool_release(void *ctx, void *ptr) {
+    tlv8_pool_t pool = (tlv8_pool_t)ctx;
+    if ((unsigned char *)ptr < pool->start || (unsigned char *)ptr >= pool->end) {
+        if (pool->fallback) {
+            pool->fallback->release(pool->fallback->ctx, ptr);
+        }
+        return;
+    }
+    portENTER_CRITICAL(&pool->lock);
+    *(void **)ptr = pool->free_list;
+    pool->free_list = ptr;
+    portEXIT_CRITICAL(&pool->lock);
+}
+
+static const tlv8_allocator_t *tlv8_allocator = &tlv8_allocator_default;
+
+static void *tlv8_mem_alloc(const tlv8_allocator_t *allocator, size_t size) {
+    return allocator->alloc(allocator->ctx, size);
+}
+
+static void tlv8_mem_free(const tlv8_allocator_t *allocator, void *ptr) {
+    if (ptr) {
+        allocator->release(allocator->ctx, ptr);
+    }
+}
+
+static void *tlv8_mem_realloc(const tlv8_allocator_t *allocator, void *ptr, size_t len, size_t size) {
+    void *data = tlv8_mem_alloc(allocator, size);
+    if (data && ptr) {
+        memcpy(data, ptr, min(len, size));
+    }
+    if (data) {
+        tlv8_mem_free(allocator, ptr);
+    }
+    return data;
+}
+
+/***********************************************************************************************************
+ * Public interface
+ ***********************************************************************************************************/
+const tlv8_allocator_t tlv8_allocator_default = {
+    .alloc = tlv8_default_alloc,
+    .release = tlv8_default_release,
+    .ctx = NULL
+};
+
+const tlv8_allocator_t tlv8_allocator_internal = {
+    .alloc = tlv8_heap_caps_alloc,
+    .release = tlv8_heap_caps_release,
+    .ctx = (void *)(uintptr_t)(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+};
+
+const tlv8_allocator_t tlv8_allocator_spiram = {
+    .alloc = tlv8_heap_caps_alloc,
+    .release = tlv8_heap_caps_release,
+    .ctx = (void *)(uintptr_t)(MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+};
+
+void tlv8_set_allocator(const tlv8_allocator_t *allocator) {
+    tlv8_allocator = allocator ? allocator : &tlv8_allocator_default;
+}
+
+const tlv8_allocator_t *tlv8_get_allocator() {
+    return tlv8_allocator;
+}
+
+void tlv8_allocator_init_heap_caps(tlv8_allocator_t *allocator, uint32_t caps) {
+    allocator->alloc = tlv8_heap_caps_alloc;
+    allocator->release = tlv8_heap_caps_release;
+    allocator->ctx = (void *)(uintptr_t)caps;
+}
+
+tlv8_pool_t tlv8_pool_new(void *storage, size_t block_size, int num_blocks, const tlv8_allocator_t *fallback) {
+    // Blocks hold the free list link and stay aligned for 64 bit members
+    block_size = (max(block_size, sizeof(void *)) + 7) & ~(size_t)7;
+    if (num_blocks <= 0) {
+        ESP_LOGE(TAG, "Pool needs at least one block, got %d", num_blocks);
+        return NULL;
+    }
+    if ((uintptr_t)storage & 7) {
+        ESP_LOGE(TAG, "Pool storage %p is not 8 byte aligned", storage);
+        return NULL;
+    }
+    // The spinlock must be in internal RAM, blocks come from the current allocator
+    tlv8_pool_t pool = (tlv8_pool_t)tlv8_mem_alloc(&tlv8_allocator_internal, sizeof(struct _tlv8_pool));
+    if (!pool) {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(struct _tlv8_pool));
+    if (!storage) {
+        // Rounded up to keep blocks aligned
+        pool->storage = tlv8_mem_alloc(tlv8_allocator, block_size * num_blocks + 7);
+        if (!pool->storage) {
+            tlv8_mem_free(&tlv8_allocator_internal, pool);
+            return NULL;
+        }
+        storage = (void *)(((uintptr_t)pool->storage + 7) & ~(uintptr_t)7);
+    }
+    pool->allocator.alloc = tlv8_pool_alloc;
+    pool->allocator.release = tlv8_pool_release;
+    pool->allocator.ctx = pool;
+    pool->owner = tlv8_allocator;
+    pool->fallback = fallback;
+    vPortCPUInitializeMutex(&pool->lock);
+    pool->start = (unsigned char *)storage;
+    pool->end = pool->start + block_size * num_blocks;
+    pool->block_size = block_size;
+    for (int i = num_blocks - 1; i >= 0; i--) {
+        void *block = pool->start + block_size * i;
+        *(void **)block = pool->free_list;
+        pool->free_list = block;
+    }
+    return pool;
+}
+
+const tlv8_allocator_t *tlv8_pool_get_allocator(tlv8_pool_t pool) {
+    return &pool->allocator;
+}
+
+void tlv8_pool_free(void *p) {
+    tlv8_pool_t pool = (tlv8_pool_t)p;
+    if (pool) {
+        if (pool->storage) {
+            tlv8_mem_free(pool->owner, pool->storage);
+        }
+        tlv8_mem_free(&tlv8_allocator_internal, pool);
+    }
+}
+
 /***********************************************************************************************************
  * TLV8
  ***********************************************************************************************************
@@ -80,11 +419,57 @@ static int tlv8_integer_len(uint64_t integer) {
     return len;
 }
 
-static tlv8_t tlv8_new(uint8_t type) {
-    tlv8_t tlv = (tlv8_t)malloc(sizeof(struct _tlv8));
+// A source either wraps a buffer or owns len bytes of data. Atomics don't work in
+// external RAM, the refcount lives in internal RAM and only the data uses allocator
+static tlv8_source_t tlv8_source_new(const tlv8_allocator_t *allocator, buffer_t buffer, int len) {
+    tlv8_source_t source = (tlv8_source_t)tlv8_mem_alloc(&tlv8_allocator_internal, sizeof(struct _tlv8_source));
+    if (!source) {
+        return NULL;
+    }
+    source->refs = 1;
+    source->allocator = allocator;
+    source->buffer = buffer;
+    source->bytes = NULL;
+    if (len) {
+        source->bytes = (unsigned char *)tlv8_mem_alloc(allocator, len);
+        if (!source->bytes) {
+            tlv8_mem_free(&tlv8_allocator_internal, source);
+            return NULL;
+        }
+    }
+    return source;
+}
+
+static void tlv8_source_retain(tlv8_source_t source) {
+    __atomic_add_fetch(&source->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void tlv8_source_release(tlv8_source_t source) {
+    if (source && !__atomic_sub_fetch(&source->refs, 1, __ATOMIC_ACQ_REL)) {
+        buffer_free(source->buffer);
+        if (source->bytes) {
+            tlv8_mem_free(source->allocator, source->bytes);
+        }
+        tlv8_mem_free(&tlv8_allocator_internal, source);
+    }
+}
+
+static const unsigned char *tlv8_data(tlv8_t tlv) {
+    if (tlv->source) {
+        if (!tlv->source->buffer) {
+            return tlv->source->bytes + tlv->offset;
+        }
+        return (const unsigned char *)buffer_get_data(tlv->source->buffer) + tlv->offset;
+    }
+    return (const unsigned char *)buffer_get_data(tlv->data.data);
+}
+
+static tlv8_t tlv8_new(uint8_t type, const tlv8_allocator_t *allocator) {
+    tlv8_t tlv = (tlv8_t)tlv8_mem_alloc(allocator, sizeof(struct _tlv8));
     if (tlv) {
         memset(tlv, 0, sizeof(struct _tlv8));
         tlv->type = type;
+        tlv->allocator = allocator;
     }
     return tlv;
 }
@@ -93,7 +478,7 @@ static tlv8_t tlv8_new(uint8_t type) {
  * Public interface
  ***********************************************************************************************************/
 tlv8_t tlv8_new_separator(uint8_t type) {
-    tlv8_t tlv = tlv8_new(type);
+    tlv8_t tlv = tlv8_new(type, tlv8_allocator);
     if (tlv) {
         tlv->data.type = TLV8_DATA_TYPE_SEPARATOR;
     }
@@ -101,7 +486,7 @@ tlv8_t tlv8_new_separator(uint8_t type) {
 }
 
 tlv8_t tlv8_new_with_integer(uint8_t type, uint64_t integer) {
-    tlv8_t tlv = tlv8_new(type);
+    tlv8_t tlv = tlv8_new(type, tlv8_allocator);
     if (tlv) {
         tlv->data.type = TLV8_DATA_TYPE_INTEGER;
         tlv->data.uint64 = integer;
@@ -114,7 +499,20 @@ tlv8_t tlv8_new_with_data(uint8_t type, void *data, int data_len) {
     if (!data || !data_len) {
         return NULL;
     }
-    tlv8_t tlv = tlv8_new(type);
+    tlv8_t tlv = tlv8_new(type, tlv8_allocator);
+    if (tlv && tlv8_allocator != &tlv8_allocator_default) {
+        // Keep the data with the allocator, NUL terminated for strings
+        tlv->source = tlv8_source_new(tlv8_allocator, NULL, data_len + 1);
+        if (!tlv->source) {
+            tlv8_free(tlv);
+            return NULL;
+        }
+        memcpy(tlv->source->bytes, data, data_len);
+        tlv->source->bytes[data_len] = 0;
+        tlv->data.type = TLV8_DATA_TYPE_BYTES;
+        tlv->len = data_len;
+        return tlv;
+    }
     tlv->data.type = TLV8_DATA_TYPE_BYTES;
     if (tlv && data_len) {
         tlv->data.data = buffer_new(data_len);
@@ -149,6 +547,22 @@ tlv8_t tlv8_new_with_buffer(uint8_t type, buffer_t data) {
 
 // Create a new TLV8 structure from mpi (type TLV8_DATA_TYPE_MPI)
 tlv8_t tlv8_new_with_mpi(uint8_t type, mbedtls_mpi *mpi) {
+    if (tlv8_allocator != &tlv8_allocator_default) {
+        // Keep the big endian value with the allocator
+        int len = mbedtls_mpi_size(mpi);
+        tlv8_t tlv = tlv8_new(type, tlv8_allocator);
+        if (!tlv) {
+            return NULL;
+        }
+        tlv->data.type = TLV8_DATA_TYPE_MPI;
+        tlv->source = tlv8_source_new(tlv8_allocator, NULL, len);
+        if (!tlv->source || mbedtls_mpi_write_binary(mpi, tlv->source->bytes, len)) {
+            tlv8_free(tlv);
+            return NULL;
+        }
+        tlv->len = len;
+        return tlv;
+    }
     mbedtls_mpi *cpy = utils_mpi_new();
     if (!cpy) {
         return NULL;
@@ -157,7 +571,7 @@ tlv8_t tlv8_new_with_mpi(uint8_t type, mbedtls_mpi *mpi) {
         mbedtls_mpi_free(cpy);
         return NULL;
     }
-    tlv8_t tlv = tlv8_new(type);
+    tlv8_t tlv = tlv8_new(type, tlv8_allocator);
     if (tlv) {
         tlv->data.type = TLV8_DATA_TYPE_MPI;
         tlv->data.mpi = cpy;
@@ -170,12 +584,16 @@ void tlv8_free(void *t) {
     tlv8_t tlv = (tlv8_t)t;
     if (tlv) {
         if (tlv->data.type == TLV8_DATA_TYPE_MPI) {
-            mbedtls_mpi_free(tlv->data.mpi);
+            if (tlv->data.mpi) {
+                mbedtls_mpi_free(tlv->data.mpi);
+            }
+            tlv8_source_release(tlv->source);
         }
         else if (tlv->data.type != TLV8_DATA_TYPE_SEPARATOR && tlv->data.type != TLV8_DATA_TYPE_INTEGER) {
             buffer_free(tlv->data.data);
+            tlv8_source_release(tlv->source);
         }
-        free(t);
+        tlv8_mem_free(tlv->allocator, t);
     }
 }
 
@@ -188,73 +606,210 @@ uint64_t tlv8_get_integer_value(tlv8_t tlv) {
 }
 
 const char *tlv8_get_string_value(tlv8_t tlv) {
-    return (const char *)buffer_get_data(tlv->data.data);
+    return (const char *)tlv8_data(tlv);
 }
 buffer_t tlv8_get_data_value(tlv8_t tlv) {
+    if (tlv->source) {
+        // Materialize the slice, the tlv stops sharing the source
+        buffer_t data = buffer_new(tlv->len);
+        if (!data) {
+            return NULL;
+        }
+        buffer_append(data, tlv8_data(tlv), tlv->len);
+        tlv8_source_release(tlv->source);
+        tlv->source = NULL;
+        tlv->data.data = data;
+    }
     return (buffer_t)tlv->data.data;
 }
 
+const unsigned char *tlv8_get_bytes_value(tlv8_t tlv) {
+    return tlv8_data(tlv);
+}
+
+int tlv8_get_length(tlv8_t tlv) {
+    return tlv->len;
+}
+
 mbedtls_mpi *tlv8_get_mpi_value(tlv8_t tlv) {
+    if (!tlv->data.mpi && tlv->source) {
+        // Rebuild the mpi from the value kept with the allocator
+        mbedtls_mpi *mpi = utils_mpi_new();
+        if (!mpi) {
+            return NULL;
+        }
+        if (mbedtls_mpi_read_binary(mpi, tlv8_data(tlv), tlv->len)) {
+            mbedtls_mpi_free(mpi);
+            return NULL;
+        }
+        tlv->data.mpi = mpi;
+    }
     return tlv->data.mpi;
 }
 
+/***********************************************************************************************************
+ * Base64
+ ***********************************************************************************************************
+ * Private interface
+ ***********************************************************************************************************/
+static const char tlv8_base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void tlv8_base64_encode_group(const unsigned char *in, int len, char *out) {
+    uint32_t group = (uint32_t)in[0] << 16;
+    if (len > 1) {
+        group|= (uint32_t)in[1] << 8;
+    }
+    if (len > 2) {
+        group|= in[2];
+    }
+    out[0] = tlv8_base64_alphabet[(group >> 18) & 0x3F];
+    out[1] = tlv8_base64_alphabet[(group >> 12) & 0x3F];
+    out[2] = len > 1 ? tlv8_base64_alphabet[(group >> 6) & 0x3F] : '=';
+    out[3] = len > 2 ? tlv8_base64_alphabet[group & 0x3F] : '=';
+}
+
+// Returns the 6 bit value of a base64 character, -1 if invalid
+static int tlv8_base64_value(char c) {
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+    if (c == '+') {
+        return 62;
+    }
+    if (c == '/') {
+        return 63;
+    }
+    return -1;
+}
+
+// Padding is only valid at the end of the last group, as "x=" or "=="
+static int tlv8_base64_decode_group(const char *in, int last, unsigned char *out) {
+    uint32_t group = 0;
+    for (int i = 0; i < 4; i++) {
+        int value = 0;
+        if (in[i] != '=') {
+            value = tlv8_base64_value(in[i]);
+        }
+        else if (!last || i < 2 || (i == 2 && in[3] != '=')) {
+            value = -1;
+        }
+        if (value < 0) {
+            return TLV8_ERR_MALFORMED_TLV;
+        }
+        group = (group << 6) | value;
+    }
+    out[0] = group >> 16;
+    out[1] = group >> 8;
+    out[2] = group;
+    return TLV8_ERR_OK;
+}
+
 /***********************************************************************************************************
  * TLV Encoder
  ***********************************************************************************************************
  * Private interface
  ***********************************************************************************************************/
 static int tlv8_encoded_size(int len) {
-    int num_fragments = ceilf((float)len / (float)TLV8_MAX_DATA_LEN);
-    int size = (num_fragments << 1) + len; // 2 bytes * num_fragments + tlv->len - Always 1 for type + 1 for size
-    return size;
+    return tlv_wire8_encoded_size(len);
+}
+
+static void tlv8_encoder_write_out(tlv8_encoder_t codec, const void *data, int len) {
+    if (codec->sink) {
+        if (!codec->sink_error && codec->sink(codec->sink_ctx, data, len)) {
+            codec->sink_error = TLV8_ERR_IO_FAILED;
+        }
+    }
+    else {
+        buffer_append(codec->data, data, len);
+    }
+}
+
+// Encode whole groups as they complete, text is written in chunks
+static void tlv8_encoder_append_base64(tlv8_encoder_t codec, const unsigned char *data, int len) {
+    char text[TLV8_BASE64_CHUNK_LEN];
+    int pos = 0;
+    while (len > 0) {
+        if (!codec->num_pending && len >= 3) {
+            tlv8_base64_encode_group(data, 3, text + pos);
+            data+= 3;
+            len-= 3;
+        }
+        else {
+            codec->pending[codec->num_pending++] = *data++;
+            len--;
+            if (codec->num_pending < 3) {
+                continue;
+            }
+            tlv8_base64_encode_group(codec->pending, 3, text + pos);
+            codec->num_pending = 0;
+        }
+        pos+= 4;
+        if (pos == TLV8_BASE64_CHUNK_LEN) {
+            tlv8_encoder_write_out(codec, text, pos);
+            pos = 0;
+        }
+    }
+    if (pos) {
+        tlv8_encoder_write_out(codec, text, pos);
+    }
+}
+
+static void tlv8_encoder_append(tlv8_encoder_t codec, const void *data, int len) {
+    if (codec->base64) {
+        tlv8_encoder_append_base64(codec, (const unsigned char *)data, len);
+    }
+    else {
+        tlv8_encoder_write_out(codec, data, len);
+    }
+}
+
+// Write a value split in fragments, each with its own header
+static void tlv8_encoder_append_value(tlv8_encoder_t codec, uint8_t type, const unsigned char *data, int len) {
+    unsigned char header[2];
+    do {
+        int size = min(len, TLV8_MAX_DATA_LEN);
+        tlv8_encoder_append(codec, header, tlv_wire8_write_header(header, type, size));
+        tlv8_encoder_append(codec, data, size);
+        data+= size;
+        len-= size;
+    } while (len > 0);
 }
 
 static void tlv8_encoder_write_buffer_separator(tlv8_encoder_t codec, tlv8_t tlv) {
-    buffer_append(codec->data, &(tlv->type), 1);
+    tlv8_encoder_append(codec, &(tlv->type), 1);
 }
 
 static void tlv8_encoder_write_buffer_integer(tlv8_encoder_t codec, tlv8_t tlv) {
-    uint8_t len = tlv->len;
+    unsigned char data[sizeof(uint64_t)];
     uint64_t integer = tlv->data.uint64;
-    buffer_append(codec->data, &(tlv->type), 1);
-    buffer_append(codec->data, &len, 1);
-    while (len > 0) {
+    for (int i = 0; i < tlv->len; i++) {
         // Little endian
-        unsigned char val = (unsigned char)integer;
-        buffer_append(codec->data, &val, 1);
+        data[i] = (unsigned char)integer;
         integer = integer >> 8;
-        len--;
     }
+    tlv8_encoder_append_value(codec, tlv->type, data, tlv->len);
 }
 
 static void tlv8_encoder_write_buffer_data(tlv8_encoder_t codec, tlv8_t tlv) {
-    int len = tlv->len;
-    const unsigned char *data = buffer_get_data(tlv->data.data);
-    int offset = 0;
-    do {
-        uint8_t size = min(len, TLV8_MAX_DATA_LEN);
-        buffer_append(codec->data, &(tlv->type), 1);
-        buffer_append(codec->data, &size, 1);
-        buffer_append(codec->data, (data + offset), size);
-        offset+= TLV8_MAX_DATA_LEN;
-        len-= TLV8_MAX_DATA_LEN;
-    } while (len > 0);
+    tlv8_encoder_append_value(codec, tlv->type, tlv8_data(tlv), tlv->len);
 }
 
 static void tlv8_encoder_write_buffer_mpi(tlv8_encoder_t codec, tlv8_t tlv) {
+    if (tlv->source) {
+        tlv8_encoder_write_buffer_data(codec, tlv);
+        return;
+    }
     int len = tlv->len;
     unsigned char bin[len];
     memset(bin, 0, len);
     mbedtls_mpi_write_binary(tlv->data.mpi, bin, len);
-    int offset = 0;
-    do {
-        uint8_t size = min(len, TLV8_MAX_DATA_LEN);
-        buffer_append(codec->data, &(tlv->type), 1);
-        buffer_append(codec->data, &size, 1);
-        buffer_append(codec->data, (bin + offset), size);
-        offset+= TLV8_MAX_DATA_LEN;
-        len-= TLV8_MAX_DATA_LEN;
-    } while (len > 0);
+    tlv8_encoder_append_value(codec, tlv->type, bin, len);
 }
 
 static void tlv8_encoder_write_buffer(tlv8_encoder_t codec, tlv8_t tlv) {
@@ -277,23 +832,78 @@ static void tlv8_encoder_write_buffer(tlv8_encoder_t codec, tlv8_t tlv) {
  * Public interface
  ***********************************************************************************************************/
 tlv8_encoder_t tlv8_encoder_new(buffer_t buffer) {
-    tlv8_encoder_t codec = (tlv8_encoder_t)malloc(sizeof(struct _tlv8_encoder));
+    return tlv8_encoder_new_with_allocator(buffer, tlv8_allocator);
+}
+
+tlv8_encoder_t tlv8_encoder_new_with_allocator(buffer_t buffer, const tlv8_allocator_t *allocator) {
+    tlv8_encoder_t codec = (tlv8_encoder_t)tlv8_mem_alloc(allocator, sizeof(struct _tlv8_encoder));
     if (codec) {
         memset(codec, 0, sizeof(struct _tlv8_encoder));
         codec->data = buffer;
+        codec->allocator = allocator;
+    }
+    return codec;
+}
+
+tlv8_encoder_t tlv8_encoder_new_base64(buffer_t buffer) {
+    if (!buffer) {
+        buffer = buffer_new(TLV8_BASE64_CHUNK_LEN);
+        if (!buffer) {
+            return NULL;
+        }
+    }
+    tlv8_encoder_t codec = tlv8_encoder_new(buffer);
+    if (codec) {
+        codec->base64 = 1;
+        codec->nested_empty = 1;
+    }
+    return codec;
+}
+
+tlv8_encoder_t tlv8_encoder_new_base64_with_sink(tlv8_sink_t sink, void *ctx) {
+    if (!sink) {
+        return NULL;
+    }
+    tlv8_encoder_t codec = tlv8_encoder_new(NULL);
+    if (codec) {
+        codec->base64 = 1;
+        codec->sink = sink;
+        codec->sink_ctx = ctx;
+        codec->nested_empty = 1;
+    }
+    return codec;
+}
+
+tlv8_encoder_t tlv8_encoder_new_with_sink(tlv8_sink_t sink, void *ctx) {
+    if (!sink) {
+        return NULL;
+    }
+    tlv8_encoder_t codec = tlv8_encoder_new(NULL);
+    if (codec) {
+        codec->sink = sink;
+        codec->sink_ctx = ctx;
+        codec->nested_empty = 1;
     }
     return codec;
 }
 
 int tlv8_encoder_encode(tlv8_encoder_t codec, tlv8_t tlv) {
     int size = tlv8_encoded_size(tlv->len);
-    if (!codec->data) {
+    if (codec->base64) {
+        size = ((size + 2) / 3) << 2;
+    }
+    if (codec->sink) {
+        if (!codec->nested_empty && tlv->type == codec->type) {
+            return TLV8_ERR_TYPE_FORBIDDEN;
+        }
+    }
+    else if (!codec->data) {
         codec->data = buffer_new(size);
         if (!codec->data) {
             return TLV8_ERR_ALLOC_FAILED;
         }
     }
-    else if (tlv->type == codec->type) {
+    else if (!codec->nested_empty && tlv->type == codec->type) {
         // Should not encode 2 consecutive TLVs with the same type
         return TLV8_ERR_TYPE_FORBIDDEN;
     }
@@ -302,16 +912,113 @@ int tlv8_encoder_encode(tlv8_encoder_t codec, tlv8_t tlv) {
     }
     tlv8_encoder_write_buffer(codec, tlv);
     codec->type = tlv->type;
+    codec->nested_empty = 0;
+    return codec->sink_error;
+}
+
+int tlv8_encoder_finish(tlv8_encoder_t codec) {
+    if (codec->base64 && codec->num_pending) {
+        char text[4];
+        tlv8_base64_encode_group(codec->pending, codec->num_pending, text);
+        codec->num_pending = 0;
+        tlv8_encoder_write_out(codec, text, 4);
+    }
+    return codec->sink_error;
+}
+
+int tlv8_encoder_reset(tlv8_encoder_t codec) {
+    // What went to a buffer can't be taken back
+    if (!codec->sink) {
+        return TLV8_ERR_INVALID_TLV;
+    }
+    codec->type = 0;
+    codec->sink_error = TLV8_ERR_OK;
+    codec->num_pending = 0;
+    codec->nested_empty = 1;
+    return TLV8_ERR_OK;
+}
+
+int tlv8_encoder_begin_nested(tlv8_encoder_t codec, uint8_t type) {
+    // Base64 text and sink output can't be fixed up once written
+    if (codec->base64 || codec->sink || codec->depth >= TLV8_MAX_NESTING_DEPTH) {
+        return TLV8_ERR_INVALID_NESTING;
+    }
+    if (!codec->data) {
+        codec->data = buffer_new(TLV8_MAX_DATA_LEN + 2);
+        if (!codec->data) {
+            return TLV8_ERR_ALLOC_FAILED;
+        }
+    }
+    else if (!codec->nested_empty && type == codec->type) {
+        // Should not encode 2 consecutive TLVs with the same type
+        return TLV8_ERR_TYPE_FORBIDDEN;
+    }
+    else if (buffer_ensure_available(codec->data, 2) != UTILS_ERR_OK) {
+        return TLV8_ERR_ALLOC_FAILED;
+    }
+    // Length is fixed up when the nested tlv is closed
+    unsigned char header[2];
+    codec->nested[codec->depth].type = type;
+    codec->nested[codec->depth].offset = buffer_get_length(codec->data);
+    codec->depth++;
+    buffer_append(codec->data, header, tlv_wire8_write_header(header, type, 0));
+    codec->nested_empty = 1;
+    return TLV8_ERR_OK;
+}
+
+int tlv8_encoder_end_nested(tlv8_encoder_t codec) {
+    if (!codec->depth) {
+        return TLV8_ERR_INVALID_NESTING;
+    }
+    codec->depth--;
+    uint8_t type = codec->nested[codec->depth].type;
+    int offset = codec->nested[codec->depth].offset;
+    int header = tlv_wire8_header_size(0);
+    int len = buffer_get_length(codec->data) - offset - header;
+    // Room for the extra headers of a value longer than a fragment
+    int extra = tlv_wire8_encoded_size(len) - len - header;
+    if (extra) {
+        static const unsigned char padding[32] = { 0 };
+        if (buffer_ensure_available(codec->data, extra) != UTILS_ERR_OK) {
+            codec->depth++;
+            return TLV8_ERR_ALLOC_FAILED;
+        }
+        for (int i = 0; i < extra; i+= sizeof(padding)) {
+            buffer_append(codec->data, padding, min(extra - i, (int)sizeof(padding)));
+        }
+    }
+    // Move fragments up from the last one, headers are written behind them
+    int num_fragments = extra / header + 1;
+    unsigned char *data = (unsigned char *)buffer_get_data(codec->data) + offset;
+    for (int i = num_fragments - 1; i >= 0; i--) {
+        int size = min(len - i * TLV8_MAX_DATA_LEN, TLV8_MAX_DATA_LEN);
+        unsigned char *fragment = data + i * (TLV8_MAX_DATA_LEN + header);
+        if (i) {
+            memmove(fragment + header, data + header + i * TLV8_MAX_DATA_LEN, size);
+        }
+        tlv_wire8_write_header(fragment, type, size);
+    }
+    codec->type = type;
+    codec->nested_empty = 0;
     return TLV8_ERR_OK;
 }
 
 // Get data buffer
 buffer_t tlv8_encoder_get_data(tlv8_encoder_t codec) {
+    if (codec->depth) {
+        // Lengths of the open nested tlvs are not written yet
+        ESP_LOGE(TAG, "Encoded data requested with %d nested tlvs still open", codec->depth);
+        return NULL;
+    }
     return codec->data;
 }
 
 // Detach data buffer
 buffer_t tlv8_encoder_detach_data(tlv8_encoder_t codec) {
+    if (codec->depth) {
+        ESP_LOGE(TAG, "Encoded data detached with %d nested tlvs still open", codec->depth);
+        return NULL;
+    }
     buffer_t data = codec->data;
     codec->data = NULL;
     return data;
@@ -322,7 +1029,7 @@ void tlv8_encoder_free(void *c) {
     tlv8_encoder_t codec = (tlv8_encoder_t)c;
     if (codec) {
         buffer_free(codec->data);
-        free(c);
+        tlv8_mem_free(codec->allocator, c);
     }
 }
 /***********************************************************************************************************
@@ -330,61 +1037,202 @@ void tlv8_encoder_free(void *c) {
  ***********************************************************************************************************
  * Private interface
  ***********************************************************************************************************/
-static uint8_t tlv8_decoder_get_type_and_advance(tlv8_decoder_t codec) {
-    return codec->data[codec->pos++];
+// Stop decoding, what was decoded so far stays valid
+static void tlv8_decoder_fail(tlv8_decoder_t codec, int error) {
+    codec->error = error;
+    codec->len = 0;
 }
 
-static uint8_t tlv8_decoder_get_size_and_advance(tlv8_decoder_t codec) {
-    return codec->data[codec->pos++];
-}
+static uint8_t tlv8_decoder_byte_base64(tlv8_decoder_t codec, int pos) {
+    // Never read past the text on malformed input
+    if (pos >= codec->len) {
+        tlv8_decoder_fail(codec, TLV8_ERR_MALFORMED_TLV);
+        return 0;
+    }
+    int group = pos / 3;
+    if (group != codec->group) {
+        int last = group == codec->num_groups - 1;
+        if (tlv8_base64_decode_group((const char *)codec->data + (group << 2), last, codec->group_data) != TLV8_ERR_OK) {
+            tlv8_decoder_fail(codec, TLV8_ERR_MALFORMED_TLV);
+            memset(codec->group_data, 0, 3);
+        }
+        codec->group = group;
+    }
+    return codec->group_data[pos - group * 3];
+}
+
+static inline uint8_t tlv8_decoder_byte(tlv8_decoder_t codec, int pos) {
+    if (codec->base64) {
+        return tlv8_decoder_byte_base64(codec, pos);
+    }
+    return codec->data[pos];
+}
+
+static void tlv8_decoder_read(tlv8_decoder_t codec, unsigned char *data, int len) {
+    if (codec->base64) {
+        for (int i = 0; i < len; i++) {
+            data[i] = tlv8_decoder_byte_base64(codec, codec->pos + i);
+        }
+    }
+    else {
+        memcpy(data, codec->data + codec->pos, len);
+    }
+    codec->pos+= len;
+}
+
+static uint8_t tlv8_decoder_get_type_and_advance(tlv8_decoder_t codec) {
+    return tlv8_decoder_byte(codec, codec->pos++);
+}
 
-static int tlv8_decoder_data_size(tlv8_decoder_t codec) {
+// Read the header at pos, a header or value running past the data stops decoding
+static int tlv8_decoder_read_header(tlv8_decoder_t codec, int pos, uint32_t *type, uint32_t *len) {
+    unsigned char header[2];
+    int avail = min(codec->len - pos, (int)sizeof(header));
+    for (int i = 0; i < avail; i++) {
+        header[i] = tlv8_decoder_byte(codec, pos + i);
+    }
+    int size = tlv_wire8_read_header(header, avail, type, len);
+    if (size < 0 || (int)*len > codec->len - pos - size) {
+        tlv8_decoder_fail(codec, TLV8_ERR_MALFORMED_TLV);
+        return TLV8_ERR_MALFORMED_TLV;
+    }
+    return size;
+}
+
+// Step over a header checked by tlv8_decoder_data_size, returns the fragment length
+static int tlv8_decoder_next_fragment(tlv8_decoder_t codec) {
+    uint32_t type, len;
+    codec->pos+= tlv8_decoder_read_header(codec, codec->pos, &type, &len);
+    return len;
+}
+
+// Size of the value at pos, all fragments joined, or an error if malformed
+static int tlv8_decoder_data_size(tlv8_decoder_t codec, int *num_fragments) {
     int size = 0;
-    int start_pos = codec->pos;
+    int pos = codec->pos;
+    *num_fragments = 0;
     do {
-        uint8_t type = tlv8_decoder_get_type_and_advance(codec);
-        if (type != codec->type) {
-            goto cleanup;
+        uint32_t type, len;
+        if (tlv8_decoder_byte(codec, pos) != codec->type) {
+            break;
+        }
+        int header = tlv8_decoder_read_header(codec, pos, &type, &len);
+        if (header < 0) {
+            return header;
         }
-        int len = tlv8_decoder_get_size_and_advance(codec);
         size+= len;
+        (*num_fragments)++;
         // Jump to next TLV if any
-        codec->pos+= len;
-    } while (tlv8_decoder_has_next(codec));
-cleanup:
-    // Restore initial pointer to type of TLV
-    codec->pos = start_pos;
+        pos+= header + len;
+    } while (pos < codec->len);
     return size;
 }
 
 static tlv8_t tlv8_decoder_next_tlv_separator(tlv8_decoder_t codec) {
     tlv8_decoder_get_type_and_advance(codec);
-    return tlv8_new_separator(codec->type);
+    tlv8_t tlv = tlv8_new(codec->type, codec->allocator);
+    if (tlv) {
+        tlv->data.type = TLV8_DATA_TYPE_SEPARATOR;
+    }
+    return tlv;
 }
 
 static tlv8_t tlv8_decoder_next_tlv_integer(tlv8_decoder_t codec) {
     uint64_t integer = 0;
-    tlv8_decoder_get_type_and_advance(codec);
-    int size = tlv8_decoder_get_size_and_advance(codec);
+    uint32_t type, len;
+    int header = tlv8_decoder_read_header(codec, codec->pos, &type, &len);
+    if (header < 0) {
+        return NULL;
+    }
+    codec->pos+= header;
+    int size = len;
     for (int i = 0; i < size; i++) {
-        uint8_t byte = codec->data[codec->pos++];
+        uint8_t byte = tlv8_decoder_byte(codec, codec->pos++);
         integer = integer | ((uint64_t)byte << (8 * i));
     }
-    return tlv8_new_with_integer(codec->type, integer);
+    tlv8_t tlv = tlv8_new(codec->type, codec->allocator);
+    if (tlv) {
+        tlv->data.type = TLV8_DATA_TYPE_INTEGER;
+        tlv->data.uint64 = integer;
+        tlv->len = tlv8_integer_len(integer);
+    }
+    return tlv;
 }
 
-static tlv8_t tlv8_decoder_next_tlv_data(tlv8_decoder_t codec) {
+static void tlv8_decoder_copy_data(tlv8_decoder_t codec, unsigned char *data, int num_fragments) {
+    for (int i = 0; i < num_fragments; i++) {
+        int len = tlv8_decoder_next_fragment(codec);
+        tlv8_decoder_read(codec, data, len);
+        data+= len;
+    }
+}
+
+// Share the buffer of a single fragment tlv instead of copying, only when the decoder owns the buffer
+static tlv8_t tlv8_decoder_next_tlv_slice(tlv8_decoder_t codec, int size) {
+    if (!codec->source) {
+        codec->source = tlv8_source_new(codec->allocator, codec->buffer, 0);
+        if (!codec->source) {
+            return NULL;
+        }
+    }
+    tlv8_t tlv = tlv8_new(codec->type, codec->allocator);
+    if (!tlv) {
+        return NULL;
+    }
+    tlv8_decoder_next_fragment(codec);
+    tlv8_source_retain(codec->source);
+    tlv->data.type = TLV8_DATA_TYPE_BYTES;
+    tlv->source = codec->source;
+    tlv->offset = codec->pos;
+    tlv->len = size;
+    codec->pos+= size;
+    return tlv;
+}
+
+static tlv8_t tlv8_decoder_next_tlv_data(tlv8_decoder_t codec, int share) {
     tlv8_t tlv = NULL;
-    int size = tlv8_decoder_data_size(codec);
-    int num_fragments = ceilf((float)size / (float)TLV8_MAX_DATA_LEN);
+    int num_fragments;
+    int size = tlv8_decoder_data_size(codec, &num_fragments);
+    if (size < 0) {
+        return NULL;
+    }
+    if (share && codec->buffer && num_fragments == 1) {
+        tlv = tlv8_decoder_next_tlv_slice(codec, size);
+        if (tlv) {
+            return tlv;
+        }
+    }
+    if (codec->allocator != &tlv8_allocator_default) {
+        // Keep the data with the decoder allocator, NUL terminated for strings
+        tlv8_source_t source = tlv8_source_new(codec->allocator, NULL, size + 1);
+        if (!source) {
+            return NULL;
+        }
+        tlv = tlv8_new(codec->type, codec->allocator);
+        if (!tlv) {
+            tlv8_source_release(source);
+            return NULL;
+        }
+        tlv8_decoder_copy_data(codec, source->bytes, num_fragments);
+        source->bytes[size] = 0;
+        tlv->data.type = TLV8_DATA_TYPE_BYTES;
+        tlv->source = source;
+        tlv->len = size;
+        return tlv;
+    }
     buffer_t data = buffer_new(size);
     for (int i = 0; i < num_fragments; i++) {
-        tlv8_decoder_get_type_and_advance(codec);
-        uint8_t len = tlv8_decoder_get_size_and_advance(codec);
+        int len = tlv8_decoder_next_fragment(codec);
+        if (codec->base64) {
+            unsigned char fragment[TLV8_MAX_DATA_LEN];
+            tlv8_decoder_read(codec, fragment, len);
+            buffer_append(data, fragment, len);
+            continue;
+        }
         buffer_append(data, codec->data + codec->pos, len);
         codec->pos+= len;
     };
-    tlv = tlv8_new(codec->type);
+    tlv = tlv8_new(codec->type, codec->allocator);
     tlv->data.type = TLV8_DATA_TYPE_BYTES;
     tlv->data.data = data;
     tlv->len = size;
@@ -392,7 +1240,7 @@ static tlv8_t tlv8_decoder_next_tlv_data(tlv8_decoder_t codec) {
 }
 
 static tlv8_t tlv8_decoder_next_tlv_string(tlv8_decoder_t codec) {
-    tlv8_t tlv = tlv8_decoder_next_tlv_data(codec);
+    tlv8_t tlv = tlv8_decoder_next_tlv_data(codec, 0);
     if (tlv) {
         tlv->data.type = TLV8_DATA_TYPE_STRING;
     }
@@ -401,26 +1249,39 @@ static tlv8_t tlv8_decoder_next_tlv_string(tlv8_decoder_t codec) {
 
 static tlv8_t tlv8_decoder_next_tlv_mpi(tlv8_decoder_t codec) {
     tlv8_t tlv = NULL;
-    int size = tlv8_decoder_data_size(codec);
-    int num_fragments = ceilf((float)size / (float)TLV8_MAX_DATA_LEN);
-    char data[size];
-    int offset = 0;
-    for (int i = 0; i < num_fragments; i++) {
-        tlv8_decoder_get_type_and_advance(codec);
-        uint8_t len = tlv8_decoder_get_size_and_advance(codec);
-        memcpy(data + offset, codec->data + codec->pos, len);
-        offset+= len;
-        codec->pos+= len;
-    };
+    if (codec->allocator != &tlv8_allocator_default) {
+        // Keep the value with the decoder allocator, the mpi is rebuilt on demand
+        tlv = tlv8_decoder_next_tlv_data(codec, 0);
+        if (tlv) {
+            tlv->data.type = TLV8_DATA_TYPE_MPI;
+        }
+        return tlv;
+    }
+    int num_fragments;
+    int size = tlv8_decoder_data_size(codec, &num_fragments);
+    if (size < 0) {
+        return NULL;
+    }
+    // Heap rather than stack, values can be several KB and batch workers have small stacks
+    unsigned char *data = (unsigned char *)tlv8_mem_alloc(codec->allocator, size ? size : 1);
+    if (!data) {
+        return NULL;
+    }
+    tlv8_decoder_copy_data(codec, data, num_fragments);
     mbedtls_mpi *mpi = utils_mpi_new();
+    if (mpi && mbedtls_mpi_read_binary(mpi, (const unsigned char *)data, size)) {
+        mbedtls_mpi_free(mpi);
+        mpi = NULL;
+    }
+    tlv8_mem_free(codec->allocator, data);
     if (!mpi) {
         return NULL;
     }
-    if (mbedtls_mpi_read_binary(mpi, (const unsigned char *)data, size)) {
+    tlv = tlv8_new(codec->type, codec->allocator);
+    if (!tlv) {
         mbedtls_mpi_free(mpi);
         return NULL;
     }
-    tlv = tlv8_new(codec->type);
     tlv->data.type = TLV8_DATA_TYPE_MPI;
     tlv->data.mpi = mpi;
     tlv->len = size;
@@ -431,12 +1292,17 @@ static tlv8_t tlv8_decoder_next_tlv_mpi(tlv8_decoder_t codec) {
  * Public interface
  ***********************************************************************************************************/
 tlv8_decoder_t tlv8_decoder_new(buffer_t data) {
+    return tlv8_decoder_new_with_allocator(data, tlv8_allocator);
+}
+
+tlv8_decoder_t tlv8_decoder_new_with_allocator(buffer_t data, const tlv8_allocator_t *allocator) {
     if (!data) {
         return NULL;
     }
-    tlv8_decoder_t codec = (tlv8_decoder_t)malloc(sizeof(struct _tlv8_decoder));
+    tlv8_decoder_t codec = (tlv8_decoder_t)tlv8_mem_alloc(allocator, sizeof(struct _tlv8_decoder));
     if (codec) {
         memset(codec, 0, sizeof(struct _tlv8_decoder));
+        codec->allocator = allocator;
         codec->buffer = data;
         codec->data = (const unsigned char *)buffer_get_data(data);
         codec->len = buffer_get_length(data);
@@ -444,10 +1310,72 @@ tlv8_decoder_t tlv8_decoder_new(buffer_t data) {
     return codec;
 }
 
+tlv8_decoder_t tlv8_decoder_new_with_data(const void *data, int data_len) {
+    return tlv8_decoder_new_with_data_and_allocator(data, data_len, tlv8_allocator);
+}
+
+tlv8_decoder_t tlv8_decoder_new_with_data_and_allocator(const void *data, int data_len, const tlv8_allocator_t *allocator) {
+    if (!data) {
+        return NULL;
+    }
+    tlv8_decoder_t codec = (tlv8_decoder_t)tlv8_mem_alloc(allocator, sizeof(struct _tlv8_decoder));
+    if (codec) {
+        memset(codec, 0, sizeof(struct _tlv8_decoder));
+        codec->allocator = allocator;
+        codec->data = (const unsigned char *)data;
+        codec->len = data_len;
+    }
+    return codec;
+}
+
+tlv8_decoder_t tlv8_decoder_new_base64(const char *text, int text_len) {
+    // Text must be made of whole padded groups
+    if (!text || (text_len & 3)) {
+        return NULL;
+    }
+    tlv8_decoder_t codec = tlv8_decoder_new_with_data(text, text_len);
+    if (codec) {
+        int len = (text_len >> 2) * 3;
+        if (text_len && text[text_len - 1] == '=') {
+            len--;
+        }
+        if (text_len > 1 && text[text_len - 2] == '=') {
+            len--;
+        }
+        codec->base64 = 1;
+        codec->num_groups = text_len >> 2;
+        codec->group = -1;
+        codec->len = len;
+    }
+    return codec;
+}
+
 // Detach data buffer
 buffer_t tlv8_decoder_detach_data(tlv8_decoder_t codec) {
     buffer_t data = codec->buffer;
+    buffer_t copy = NULL;
+    tlv8_source_t source = codec->source;
+    if (data && source && __atomic_load_n(&source->refs, __ATOMIC_ACQUIRE) > 1) {
+        // Decoded tlvs still slice the buffer, give them a private copy first
+        // Whole buffer, len is cleared once decoding has failed
+        int len = buffer_get_length(data);
+        copy = buffer_new(len);
+        if (!copy) {
+            // Nothing changed, the decoder still owns the buffer
+            ESP_LOGE(TAG, "Could not copy shared buffer on detach");
+            codec->error = TLV8_ERR_ALLOC_FAILED;
+            return NULL;
+        }
+        buffer_append(copy, buffer_get_data(data), len);
+    }
     codec->buffer = NULL;
+    // Once detached, slices keep the copy made then
+    if (data && source) {
+        source->buffer = copy;
+        if (copy) {
+            codec->data = (const unsigned char *)buffer_get_data(copy);
+        }
+    }
     return data;
 }
 
@@ -456,36 +1384,951 @@ int tlv8_decoder_has_next(tlv8_decoder_t codec) {
 }
 
 uint8_t tlv8_decoder_peek_type(tlv8_decoder_t codec) {
-    codec->type = codec->data[codec->pos];
+    codec->type = tlv8_decoder_byte(codec, codec->pos);
     return codec->type;
 }
 
 tlv8_t tlv8_decoder_decode(tlv8_decoder_t codec, TLV8_DATA_TYPE type) {
+    tlv8_t tlv = NULL;
+    int error = codec->error;
     if (!tlv8_decoder_has_next(codec)) {
         return NULL;
     }
     switch (type) {
         case TLV8_DATA_TYPE_SEPARATOR:
-            return tlv8_decoder_next_tlv_separator(codec);
+            tlv = tlv8_decoder_next_tlv_separator(codec); break;
         case TLV8_DATA_TYPE_INTEGER:
-            return tlv8_decoder_next_tlv_integer(codec);
+            tlv = tlv8_decoder_next_tlv_integer(codec); break;
         case TLV8_DATA_TYPE_STRING:
-            return tlv8_decoder_next_tlv_string(codec);
+            tlv = tlv8_decoder_next_tlv_string(codec); break;
         case TLV8_DATA_TYPE_BYTES:
-            return tlv8_decoder_next_tlv_data(codec);
+            tlv = tlv8_decoder_next_tlv_data(codec, 1); break;
         case TLV8_DATA_TYPE_MPI:
-            return tlv8_decoder_next_tlv_mpi(codec);
+            tlv = tlv8_decoder_next_tlv_mpi(codec); break;
         default:
             // Nothing to return, we don't know that type
-            return NULL;
+            break;
+    }
+    if (codec->error != error) {
+        // The value was read from malformed data
+        tlv8_free(tlv);
+        return NULL;
     }
+    return tlv;
+}
+
+int tlv8_decoder_get_error(tlv8_decoder_t codec) {
+    return codec->error;
 }
 
 void tlv8_decoder_free(void *c) {
     tlv8_decoder_t codec = (tlv8_decoder_t)c;
     if (codec) {
-        buffer_free(codec->buffer);
-        free(c);
+        if (codec->source) {
+            // The buffer is freed with the last tlv slicing it
+            tlv8_source_release(codec->source);
+        }
+        else {
+            buffer_free(codec->buffer);
+        }
+        tlv8_mem_free(codec->allocator, c);
+    }
+}
+
+/***********************************************************************************************************
+ * TLV Template
+ ***********************************************************************************************************
+ * Private interface
+ ***********************************************************************************************************/
+// Exact number of bytes needed to encode a tlv, a data tlv of length 0 still takes a header
+static int tlv8_raw_size(tlv8_t tlv) {
+    switch (tlv->data.type) {
+        case TLV8_DATA_TYPE_SEPARATOR:
+            return 1;
+        case TLV8_DATA_TYPE_INTEGER:
+            return tlv->len + 2;
+        default:
+            return tlv8_encoded_size(tlv->len);
+    }
+}
+
+// Write the encoded tlv in out, which must hold at least tlv8_raw_size bytes
+static int tlv8_raw_write(unsigned char *out, tlv8_t tlv) {
+    switch (tlv->data.type) {
+        case TLV8_DATA_TYPE_SEPARATOR:
+            out[0] = tlv->type;
+            return 1;
+        case TLV8_DATA_TYPE_INTEGER: {
+            uint64_t integer = tlv->data.uint64;
+            int header = tlv_wire8_write_header(out, tlv->type, tlv->len);
+            for (int i = 0; i < tlv->len; i++) {
+                // Little endian
+                out[header + i] = (unsigned char)integer;
+                integer = integer >> 8;
+            }
+            return header + tlv->len;
+        }
+        case TLV8_DATA_TYPE_STRING:
+        case TLV8_DATA_TYPE_BYTES:
+            return tlv_wire8_write(out, tlv->type, tlv8_data(tlv), tlv->len);
+        case TLV8_DATA_TYPE_MPI: {
+            if (tlv->source) {
+                return tlv_wire8_write(out, tlv->type, tlv8_data(tlv), tlv->len);
+            }
+            int len = tlv->len;
+            unsigned char bin[len];
+            memset(bin, 0, len);
+            mbedtls_mpi_write_binary(tlv->data.mpi, bin, len);
+            return tlv_wire8_write(out, tlv->type, bin, len);
+        }
+        default:
+            return 0;
+    }
+}
+
+// Copy data over the value of an encoded tlv, skipping the fragment headers
+static void tlv8_raw_patch(unsigned char *out, const unsigned char *data, int len) {
+    while (len > 0) {
+        int size = min(len, TLV8_MAX_DATA_LEN);
+        int header = tlv_wire8_header_size(size);
+        memcpy(out + header, data, size);
+        out+= header + size;
+        data+= size;
+        len-= size;
+    }
+}
+
+static int tlv8_template_reserve(tlv8_template_t tmpl, uint8_t type, int size) {
+    if (tmpl->count >= TLV8_TEMPLATE_MAX_SLOTS) {
+        return TLV8_ERR_OUT_OF_MEMORY;
+    }
+    if (tmpl->count && type == tmpl->type) {
+        // Should not encode 2 consecutive TLVs with the same type
+        return TLV8_ERR_TYPE_FORBIDDEN;
+    }
+    if (tmpl->len + size > tmpl->capacity) {
+        int capacity = (tmpl->len + size) << 1;
+        unsigned char *data = (unsigned char *)tlv8_mem_realloc(tmpl->allocator, tmpl->data, tmpl->len, capacity);
+        if (!data) {
+            return TLV8_ERR_ALLOC_FAILED;
+        }
+        tmpl->data = data;
+        tmpl->capacity = capacity;
+    }
+    return TLV8_ERR_OK;
+}
+
+static int tlv8_template_push(tlv8_template_t tmpl, uint8_t type, int size, int len) {
+    int slot = tmpl->count++;
+    tmpl->slots[slot].type = type;
+    tmpl->slots[slot].offset = tmpl->len;
+    tmpl->slots[slot].len = len;
+    tmpl->len+= size;
+    tmpl->type = type;
+    return slot;
+}
+
+/***********************************************************************************************************
+ * Public interface
+ ***********************************************************************************************************/
+tlv8_template_t tlv8_template_new() {
+    tlv8_template_t tmpl = (tlv8_template_t)tlv8_mem_alloc(tlv8_allocator, sizeof(struct _tlv8_template));
+    if (tmpl) {
+        memset(tmpl, 0, sizeof(struct _tlv8_template));
+        tmpl->allocator = tlv8_allocator;
+    }
+    return tmpl;
+}
+
+int tlv8_template_add(tlv8_template_t tmpl, tlv8_t tlv) {
+    if (!tlv) {
+        return TLV8_ERR_INVALID_TLV;
+    }
+    int ret;
+    int size = tlv8_raw_size(tlv);
+    if ((ret = tlv8_template_reserve(tmpl, tlv->type, size)) != TLV8_ERR_OK) {
+        return ret;
+    }
+    tlv8_raw_write(tmpl->data + tmpl->len, tlv);
+    return tlv8_template_push(tmpl, tlv->type, size, tlv->len);
+}
+
+int tlv8_template_add_slot(tlv8_template_t tmpl, uint8_t type, int len) {
+    if (len < 0) {
+        return TLV8_ERR_INVALID_TLV;
+    }
+    int ret;
+    int size = tlv8_encoded_size(len);
+    if ((ret = tlv8_template_reserve(tmpl, type, size)) != TLV8_ERR_OK) {
+        return ret;
+    }
+    tlv_wire8_write(tmpl->data + tmpl->len, type, NULL, len);
+    return tlv8_template_push(tmpl, type, size, len);
+}
+
+int tlv8_template_set_integer(tlv8_template_t tmpl, int slot, uint64_t integer) {
+    if (slot < 0 || slot >= tmpl->count || tmpl->slots[slot].len > TLV8_MAX_DATA_LEN) {
+        return TLV8_ERR_INVALID_TLV;
+    }
+    int len = tmpl->slots[slot].len;
+    if (tlv8_integer_len(integer) > len) {
+        return TLV8_ERR_INVALID_TLV;
+    }
+    unsigned char *out = tmpl->data + tmpl->slots[slot].offset + tlv_wire8_header_size(len);
+    for (int i = 0; i < len; i++) {
+        // Little endian
+        out[i] = (unsigned char)integer;
+        integer = integer >> 8;
+    }
+    return TLV8_ERR_OK;
+}
+
+int tlv8_template_set_data(tlv8_template_t tmpl, int slot, const void *data, int data_len) {
+    if (slot < 0 || slot >= tmpl->count || data_len != tmpl->slots[slot].len) {
+        return TLV8_ERR_INVALID_TLV;
+    }
+    tlv8_raw_patch(tmpl->data + tmpl->slots[slot].offset, (const unsigned char *)data, data_len);
+    return TLV8_ERR_OK;
+}
+
+buffer_t tlv8_template_encode(tlv8_template_t tmpl) {
+    buffer_t buffer = buffer_new(tmpl->len);
+    if (buffer) {
+        buffer_append(buffer, tmpl->data, tmpl->len);
+    }
+    return buffer;
+}
+
+int tlv8_template_encode_into(tlv8_template_t tmpl, buffer_t buffer) {
+    if (buffer_ensure_available(buffer, tmpl->len) != UTILS_ERR_OK) {
+        return TLV8_ERR_ALLOC_FAILED;
+    }
+    buffer_append(buffer, tmpl->data, tmpl->len);
+    return TLV8_ERR_OK;
+}
+
+void tlv8_template_free(void *t) {
+    tlv8_template_t tmpl = (tlv8_template_t)t;
+    if (tmpl) {
+        tlv8_mem_free(tmpl->allocator, tmpl->data);
+        tlv8_mem_free(tmpl->allocator, t);
+    }
+}
+
+/***********************************************************************************************************
+ * TLV Message
+ ***********************************************************************************************************
+ * Private interface
+ ***********************************************************************************************************/
+// Encoded size of the tlv at offset, including all its fragments
+static int tlv8_message_item_size(tlv8_message_t msg, int offset) {
+    uint8_t type = msg->data[offset];
+    if (msg->mapping && msg->mapping[type] == TLV8_DATA_TYPE_SEPARATOR) {
+        return 1;
+    }
+    tlv_wire8_item_t item;
+    if (tlv_wire8_next(msg->data, msg->len, offset, &item) < 0) {
+        return TLV8_ERR_MALFORMED_TLV;
+    }
+    return item.size;
+}
+
+// A separator is a lone type byte, the mapping must agree or the message can't be walked anymore
+static int tlv8_message_check(tlv8_message_t msg, tlv8_t tlv) {
+    int separator = msg->mapping && msg->mapping[tlv->type] == TLV8_DATA_TYPE_SEPARATOR;
+    if (separator != (tlv->data.type == TLV8_DATA_TYPE_SEPARATOR)) {
+        return TLV8_ERR_INVALID_TYPE;
+    }
+    return TLV8_ERR_OK;
+}
+
+// Find the tlv of a given type, or the end of the message if type is negative
+static int tlv8_message_find(tlv8_message_t msg, int type, tlv8_message_item_t *item) {
+    int offset = 0;
+    item->prev_type = -1;
+    while (offset < msg->len) {
+        int size = tlv8_message_item_size(msg, offset);
+        if (size < 0) {
+            return size;
+        }
+        if (msg->data[offset] == type) {
+            item->offset = offset;
+            item->size = size;
+            item->next_type = offset + size < msg->len ? msg->data[offset + size] : -1;
+            return TLV8_ERR_OK;
+        }
+        item->prev_type = msg->data[offset];
+        offset+= size;
+    }
+    if (type >= 0) {
+        return TLV8_ERR_INVALID_TYPE;
+    }
+    item->offset = msg->len;
+    item->size = 0;
+    item->next_type = -1;
+    return TLV8_ERR_OK;
+}
+
+// Resize the size bytes at offset to new_size bytes, moving the rest of the message
+static int tlv8_message_splice(tlv8_message_t msg, int offset, int size, int new_size) {
+    int len = msg->len - size + new_size;
+    if (len > msg->capacity) {
+        int capacity = len << 1;
+        unsigned char *data = (unsigned char *)tlv8_mem_realloc(msg->allocator, msg->data, msg->len, capacity);
+        if (!data) {
+            return TLV8_ERR_ALLOC_FAILED;
+        }
+        msg->data = data;
+        msg->capacity = capacity;
+    }
+    memmove(msg->data + offset + new_size, msg->data + offset + size, msg->len - offset - size);
+    msg->len = len;
+    return TLV8_ERR_OK;
+}
+
+/***********************************************************************************************************
+ * Public interface
+ ***********************************************************************************************************/
+tlv8_message_t tlv8_message_new(buffer_t buffer, const TLV8_DATA_TYPE *mapping) {
+    tlv8_message_t msg = (tlv8_message_t)tlv8_mem_alloc(tlv8_allocator, sizeof(struct _tlv8_message));
+    if (!msg) {
+        return NULL;
+    }
+    memset(msg, 0, sizeof(struct _tlv8_message));
+    msg->allocator = tlv8_allocator;
+    msg->mapping = mapping;
+    int len = buffer ? buffer_get_length(buffer) : 0;
+    if (len) {
+        msg->data = (unsigned char *)tlv8_mem_alloc(msg->allocator, len);
+        if (!msg->data) {
+            tlv8_mem_free(msg->allocator, msg);
+            return NULL;
+        }
+        memcpy(msg->data, buffer_get_data(buffer), len);
+        msg->len = len;
+        msg->capacity = len;
+    }
+    return msg;
+}
+
+int tlv8_message_replace(tlv8_message_t msg, tlv8_t tlv) {
+    int ret;
+    tlv8_message_item_t item;
+    if (!tlv) {
+        return TLV8_ERR_INVALID_TLV;
+    }
+    ESP32_TLV8_CHK(tlv8_message_check(msg, tlv));
+    ESP32_TLV8_CHK(tlv8_message_find(msg, tlv->type, &item));
+    int size = tlv8_raw_size(tlv);
+    if (size != item.size) {
+        ESP32_TLV8_CHK(tlv8_message_splice(msg, item.offset, item.size, size));
+    }
+    tlv8_raw_write(msg->data + item.offset, tlv);
+cleanup:
+    return ret;
+}
+
+int tlv8_message_insert(tlv8_message_t msg, tlv8_t tlv, int before_type) {
+    int ret;
+    tlv8_message_item_t item;
+    if (!tlv) {
+        return TLV8_ERR_INVALID_TLV;
+    }
+    ESP32_TLV8_CHK(tlv8_message_check(msg, tlv));
+    ESP32_TLV8_CHK(tlv8_message_find(msg, before_type, &item));
+    if (item.prev_type == tlv->type || before_type == tlv->type) {
+        // Should not encode 2 consecutive TLVs with the same type
+        return TLV8_ERR_TYPE_FORBIDDEN;
+    }
+    int size = tlv8_raw_size(tlv);
+    ESP32_TLV8_CHK(tlv8_message_splice(msg, item.offset, 0, size));
+    tlv8_raw_write(msg->data + item.offset, tlv);
+cleanup:
+    return ret;
+}
+
+int tlv8_message_remove(tlv8_message_t msg, uint8_t type) {
+    int ret;
+    tlv8_message_item_t item;
+    ESP32_TLV8_CHK(tlv8_message_find(msg, type, &item));
+    if (item.prev_type >= 0 && item.prev_type == item.next_type) {
+        // The surrounding TLVs would merge
+        return TLV8_ERR_TYPE_FORBIDDEN;
+    }
+    ESP32_TLV8_CHK(tlv8_message_splice(msg, item.offset, item.size, 0));
+cleanup:
+    return ret;
+}
+
+const unsigned char *tlv8_message_get_data(tlv8_message_t msg) {
+    return msg->data;
+}
+
+int tlv8_message_get_length(tlv8_message_t msg) {
+    return msg->len;
+}
+
+buffer_t tlv8_message_encode(tlv8_message_t msg) {
+    buffer_t buffer = buffer_new(msg->len);
+    if (buffer) {
+        buffer_append(buffer, msg->data, msg->len);
+    }
+    return buffer;
+}
+
+void tlv8_message_free(void *m) {
+    tlv8_message_t msg = (tlv8_message_t)m;
+    if (msg) {
+        tlv8_mem_free(msg->allocator, msg->data);
+        tlv8_mem_free(msg->allocator, m);
+    }
+}
+
+/***********************************************************************************************************
+ * TLV Capture
+ ***********************************************************************************************************
+ * Private interface
+ ***********************************************************************************************************/
+static void tlv8_capture_put_uint(unsigned char *out, uint64_t value, int len) {
+    for (int i = 0; i < len; i++) {
+        // Little endian
+        out[i] = (unsigned char)value;
+        value = value >> 8;
+    }
+}
+
+// Byte wise read, capture data may be unaligned or in mapped flash
+static uint64_t tlv8_capture_get_uint(const unsigned char *in, int len) {
+    uint64_t value = 0;
+    for (int i = 0; i < len; i++) {
+        value = value | ((uint64_t)in[i] << (8 * i));
+    }
+    return value;
+}
+
+static int tlv8_capture_writer_append(tlv8_capture_writer_t writer, const void *data, int data_len) {
+    if (data_len && fwrite(data, 1, data_len, writer->file) != (size_t)data_len) {
+        return TLV8_ERR_IO_FAILED;
+    }
+    writer->pos+= data_len;
+    return TLV8_ERR_OK;
+}
+
+static int tlv8_capture_reader_open(tlv8_capture_reader_t reader, const unsigned char *data, size_t data_len) {
+    if (data_len < TLV8_CAPTURE_HEADER_LEN || memcmp(data, TLV8_CAPTURE_MAGIC, 4)) {
+        return TLV8_ERR_INVALID_CAPTURE;
+    }
+    if (tlv8_capture_get_uint(data + 4, 2) != TLV8_CAPTURE_VERSION) {
+        return TLV8_ERR_INVALID_CAPTURE;
+    }
+    uint32_t index_offset = tlv8_capture_get_uint(data + 8, 4);
+    uint32_t count = tlv8_capture_get_uint(data + 12, 4);
+    // An unfinished capture has no index
+    if (index_offset < TLV8_CAPTURE_HEADER_LEN || index_offset > data_len || count > (data_len - index_offset) >> 2) {
+        return TLV8_ERR_INVALID_CAPTURE;
+    }
+    reader->data = data;
+    reader->len = index_offset;
+    reader->count = count;
+    reader->index = data + index_offset;
+    return TLV8_ERR_OK;
+}
+
+/***********************************************************************************************************
+ * Public interface
+ ***********************************************************************************************************/
+tlv8_capture_writer_t tlv8_capture_writer_new(FILE *file) {
+    if (!file) {
+        return NULL;
+    }
+    tlv8_capture_writer_t writer = (tlv8_capture_writer_t)tlv8_mem_alloc(tlv8_allocator, sizeof(struct _tlv8_capture_writer));
+    if (!writer) {
+        return NULL;
+    }
+    memset(writer, 0, sizeof(struct _tlv8_capture_writer));
+    writer->allocator = tlv8_allocator;
+    writer->file = file;
+    writer->start = ftell(file);
+    unsigned char header[TLV8_CAPTURE_HEADER_LEN];
+    memset(header, 0, TLV8_CAPTURE_HEADER_LEN);
+    memcpy(header, TLV8_CAPTURE_MAGIC, 4);
+    tlv8_capture_put_uint(header + 4, TLV8_CAPTURE_VERSION, 2);
+    if (writer->start < 0 || tlv8_capture_writer_append(writer, header, TLV8_CAPTURE_HEADER_LEN) != TLV8_ERR_OK) {
+        tlv8_mem_free(writer->allocator, writer);
+        return NULL;
+    }
+    return writer;
+}
+
+int tlv8_capture_writer_write(tlv8_capture_writer_t writer, uint64_t timestamp, TLV8_CAPTURE_DIRECTION direction, const void *data, int data_len) {
+    int ret;
+    if (data_len < 0 || (data_len && !data)) {
+        return TLV8_ERR_INVALID_TLV;
+    }
+    if (writer->count == writer->capacity) {
+        int capacity = writer->capacity ? writer->capacity << 1 : 64;
+        uint32_t *index = (uint32_t *)tlv8_mem_realloc(writer->allocator, writer->index, writer->count * sizeof(uint32_t), capacity * sizeof(uint32_t));
+        if (!index) {
+            return TLV8_ERR_ALLOC_FAILED;
+        }
+        writer->index = index;
+        writer->capacity = capacity;
+    }
+    unsigned char header[TLV8_CAPTURE_RECORD_HEADER_LEN];
+    memset(header, 0, TLV8_CAPTURE_RECORD_HEADER_LEN);
+    tlv8_capture_put_uint(header, timestamp, 8);
+    header[8] = direction;
+    tlv8_capture_put_uint(header + 12, data_len, 4);
+    uint32_t offset = writer->pos;
+    ESP32_TLV8_CHK(tlv8_capture_writer_append(writer, header, TLV8_CAPTURE_RECORD_HEADER_LEN));
+    ESP32_TLV8_CHK(tlv8_capture_writer_append(writer, data, data_len));
+    writer->index[writer->count++] = offset;
+cleanup:
+    return ret;
+}
+
+int tlv8_capture_writer_close(tlv8_capture_writer_t writer) {
+    int ret = TLV8_ERR_OK;
+    uint32_t index_offset = writer->pos;
+    unsigned char value[8];
+    for (int i = 0; i < writer->count; i++) {
+        tlv8_capture_put_uint(value, writer->index[i], 4);
+        ESP32_TLV8_CHK(tlv8_capture_writer_append(writer, value, 4));
+    }
+    // Complete the header, the capture is only readable from now on
+    tlv8_capture_put_uint(value, index_offset, 4);
+    tlv8_capture_put_uint(value + 4, writer->count, 4);
+    if (fseek(writer->file, writer->start + 8, SEEK_SET) ||
+        fwrite(value, 1, 8, writer->file) != 8 ||
+        fseek(writer->file, writer->start + writer->pos, SEEK_SET) ||
+        fflush(writer->file)) {
+        ret = TLV8_ERR_IO_FAILED;
+    }
+cleanup:
+    tlv8_mem_free(writer->allocator, writer->index);
+    tlv8_mem_free(writer->allocator, writer);
+    return ret;
+}
+
+tlv8_capture_reader_t tlv8_capture_reader_new(const void *data, size_t data_len) {
+    if (!data) {
+        return NULL;
+    }
+    tlv8_capture_reader_t reader = (tlv8_capture_reader_t)tlv8_mem_alloc(tlv8_allocator, sizeof(struct _tlv8_capture_reader));
+    if (reader) {
+        memset(reader, 0, sizeof(struct _tlv8_capture_reader));
+        reader->allocator = tlv8_allocator;
+        if (tlv8_capture_reader_open(reader, (const unsigned char *)data, data_len) != TLV8_ERR_OK) {
+            tlv8_mem_free(reader->allocator, reader);
+            return NULL;
+        }
+    }
+    return reader;
+}
+
+tlv8_capture_reader_t tlv8_capture_reader_new_with_partition(const esp_partition_t *partition) {
+    if (!partition) {
+        return NULL;
+    }
+    tlv8_capture_reader_t reader = (tlv8_capture_reader_t)tlv8_mem_alloc(tlv8_allocator, sizeof(struct _tlv8_capture_reader));
+    if (!reader) {
+        return NULL;
+    }
+    memset(reader, 0, sizeof(struct _tlv8_capture_reader));
+    reader->allocator = tlv8_allocator;
+    const void *data;
+    if (esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &data, &reader->handle) != ESP_OK) {
+        ESP_LOGE(TAG, "Could not map capture partition");
+        tlv8_mem_free(reader->allocator, reader);
+        return NULL;
+    }
+    reader->mapped = 1;
+    if (tlv8_capture_reader_open(reader, (const unsigned char *)data, partition->size) != TLV8_ERR_OK) {
+        tlv8_capture_reader_free(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+int tlv8_capture_reader_count(tlv8_capture_reader_t reader) {
+    return reader->count;
+}
+
+int tlv8_capture_reader_get(tlv8_capture_reader_t reader, int index, tlv8_capture_record_t *record) {
+    if (index < 0 || index >= reader->count) {
+        return TLV8_ERR_INVALID_CAPTURE;
+    }
+    uint32_t offset = tlv8_capture_get_uint(reader->index + (index << 2), 4);
+    if (offset < TLV8_CAPTURE_HEADER_LEN || offset > reader->len - TLV8_CAPTURE_RECORD_HEADER_LEN) {
+        return TLV8_ERR_INVALID_CAPTURE;
+    }
+    const unsigned char *header = reader->data + offset;
+    uint32_t len = tlv8_capture_get_uint(header + 12, 4);
+    if (len > reader->len - offset - TLV8_CAPTURE_RECORD_HEADER_LEN) {
+        return TLV8_ERR_INVALID_CAPTURE;
+    }
+    record->timestamp = tlv8_capture_get_uint(header, 8);
+    record->direction = (TLV8_CAPTURE_DIRECTION)header[8];
+    record->data = header + TLV8_CAPTURE_RECORD_HEADER_LEN;
+    record->len = len;
+    return TLV8_ERR_OK;
+}
+
+tlv8_decoder_t tlv8_capture_reader_decoder(tlv8_capture_reader_t reader, int index) {
+    tlv8_capture_record_t record;
+    if (tlv8_capture_reader_get(reader, index, &record) != TLV8_ERR_OK) {
+        return NULL;
+    }
+    return tlv8_decoder_new_with_data(record.data, record.len);
+}
+
+void tlv8_capture_reader_free(void *r) {
+    tlv8_capture_reader_t reader = (tlv8_capture_reader_t)r;
+    if (reader) {
+        if (reader->mapped) {
+            spi_flash_munmap(reader->handle);
+        }
+        tlv8_mem_free(reader->allocator, r);
+    }
+}
+
+/***********************************************************************************************************
+ * TLV Parser
+ ***********************************************************************************************************
+ * Private interface
+ ***********************************************************************************************************/
+// Spans are handed out in fixed size batches, whatever the number of fragments
+static int tlv8_parse_item(const tlv8_handler_t *handler, const tlv_wire8_item_t *item) {
+    int ret = TLV8_ERR_OK;
+    const unsigned char *data = item->start;
+    tlv8_span_t spans[TLV8_PARSE_MAX_SPANS];
+    int num_spans = 0;
+    for (int i = 0; i < item->num_fragments; i++) {
+        uint32_t type, len;
+        data+= tlv_wire8_read_header(data, item->size - (int)(data - item->start), &type, &len);
+        spans[num_spans].data = data;
+        spans[num_spans].len = len;
+        data+= len;
+        if (++num_spans == TLV8_PARSE_MAX_SPANS || i == item->num_fragments - 1) {
+            const unsigned char *value = item->num_fragments == 1 ? spans[0].data : NULL;
+            ESP32_TLV8_CHK(handler->callback(handler->ctx, item->type, value, item->len, spans, num_spans));
+            num_spans = 0;
+        }
+    }
+cleanup:
+    return ret;
+}
+
+/***********************************************************************************************************
+ * Public interface
+ ***********************************************************************************************************/
+int tlv8_parse(const void *data, int data_len, const tlv8_handler_t handlers[256], const TLV8_DATA_TYPE *mapping) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    int pos = 0;
+    int ret = TLV8_ERR_OK;
+    while (pos < data_len) {
+        uint8_t type = bytes[pos];
+        const tlv8_handler_t *handler = &handlers[type];
+        if (mapping && mapping[type] == TLV8_DATA_TYPE_SEPARATOR) {
+            pos++;
+            if (handler->callback) {
+                ESP32_TLV8_CHK(handler->callback(handler->ctx, type, NULL, 0, NULL, 0));
+            }
+            continue;
+        }
+        tlv_wire8_item_t item;
+        int next = tlv_wire8_next(bytes, data_len, pos, &item);
+        if (next < 0) {
+            return TLV8_ERR_MALFORMED_TLV;
+        }
+        if (handler->callback) {
+            ESP32_TLV8_CHK(tlv8_parse_item(handler, &item));
+        }
+        pos = next;
+    }
+cleanup:
+    return ret;
+}
+
+uint64_t tlv8_parse_integer(const unsigned char *data, int len) {
+    uint64_t integer = 0;
+    for (int i = 0; i < len && i < 8; i++) {
+        integer = integer | ((uint64_t)data[i] << (8 * i));
+    }
+    return integer;
+}
+
+/***********************************************************************************************************
+ * TLV Cache
+ ***********************************************************************************************************
+ * Private interface
+ ***********************************************************************************************************/
+// Append base64 text to an entry, room was made for all of it
+static int tlv8_cache_entry_sink(void *ctx, const void *data, int len) {
+    tlv8_cache_entry_t entry = (tlv8_cache_entry_t)ctx;
+    memcpy(entry->base64 + entry->base64_len, data, len);
+    entry->base64_len+= len;
+    return TLV8_ERR_OK;
+}
+
+static tlv8_cache_entry_t tlv8_cache_entry_new(tlv8_cache_t cache, uint32_t version) {
+    buffer_t data = tlv8_encode_array(cache->array);
+    const unsigned char *bytes = data ? (const unsigned char *)buffer_get_data(data) : NULL;
+    int len = data ? buffer_get_length(data) : 0;
+    int text_len = cache->base64 ? ((len + 2) / 3) << 2 : 0;
+    // The refcount must be in internal RAM, the text comes from the cache allocator
+    tlv8_cache_entry_t entry = (tlv8_cache_entry_t)tlv8_mem_alloc(&tlv8_allocator_internal, sizeof(struct _tlv8_cache_entry));
+    if (!entry) {
+        buffer_free(data);
+        return NULL;
+    }
+    entry->refs = 1;
+    entry->version = version;
+    entry->allocator = cache->allocator;
+    entry->data = data;
+    entry->base64 = NULL;
+    entry->base64_len = 0;
+    if (cache->base64) {
+        // Same text as a base64 encoder writing the array
+        entry->base64 = (char *)tlv8_mem_alloc(cache->allocator, text_len + 1);
+        tlv8_encoder_t codec = entry->base64 ? tlv8_encoder_new_base64_with_sink(tlv8_cache_entry_sink, entry) : NULL;
+        if (!codec) {
+            buffer_free(data);
+            if (entry->base64) {
+                tlv8_mem_free(cache->allocator, entry->base64);
+            }
+            tlv8_mem_free(&tlv8_allocator_internal, entry);
+            return NULL;
+        }
+        tlv8_encoder_append(codec, bytes, len);
+        tlv8_encoder_finish(codec);
+        tlv8_encoder_free(codec);
+        entry->base64[entry->base64_len] = 0;
+    }
+    return entry;
+}
+
+static void tlv8_cache_entry_retain(tlv8_cache_entry_t entry) {
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+}
+
+// Encode again unless another task just did, readers only wait for the entry swap
+static tlv8_cache_entry_t tlv8_cache_refresh(tlv8_cache_t cache) {
+    tlv8_cache_entry_t old = NULL;
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    uint32_t version = __atomic_load_n(&cache->version, __ATOMIC_SEQ_CST);
+    // Only refreshes replace the entry, it can't go away while the mutex is held
+    tlv8_cache_entry_t entry = cache->entry;
+    if (!entry || entry->version != version) {
+        entry = tlv8_cache_entry_new(cache, version);
+        if (entry) {
+            portENTER_CRITICAL(&cache->entry_lock);
+            old = cache->entry;
+            cache->entry = entry;
+            portEXIT_CRITICAL(&cache->entry_lock);
+        }
+    }
+    if (entry) {
+        tlv8_cache_entry_retain(entry);
+    }
+    xSemaphoreGive(cache->lock);
+    // Readers retain under the spinlock, none of them can still be picking the old entry up
+    tlv8_cache_entry_release(old);
+    return entry;
+}
+
+/***********************************************************************************************************
+ * Public interface
+ ***********************************************************************************************************/
+tlv8_cache_t tlv8_cache_new(array_t array, int base64) {
+    if (!array) {
+        return NULL;
+    }
+    // The spinlock and version counter must be in internal RAM
+    tlv8_cache_t cache = (tlv8_cache_t)tlv8_mem_alloc(&tlv8_allocator_internal, sizeof(struct _tlv8_cache));
+    if (!cache) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(struct _tlv8_cache));
+    cache->lock = xSemaphoreCreateMutex();
+    if (!cache->lock) {
+        tlv8_mem_free(&tlv8_allocator_internal, cache);
+        return NULL;
+    }
+    vPortCPUInitializeMutex(&cache->entry_lock);
+    cache->allocator = tlv8_allocator;
+    cache->array = array;
+    cache->base64 = base64;
+    return cache;
+}
+
+void tlv8_cache_invalidate(tlv8_cache_t cache) {
+    __atomic_add_fetch(&cache->version, 1, __ATOMIC_SEQ_CST);
+}
+
+tlv8_cache_entry_t tlv8_cache_get(tlv8_cache_t cache) {
+    uint32_t version = __atomic_load_n(&cache->version, __ATOMIC_SEQ_CST);
+    // A few instructions, a refresh only holds the spinlock to swap the entry
+    portENTER_CRITICAL(&cache->entry_lock);
+    tlv8_cache_entry_t entry = cache->entry;
+    if (entry && entry->version == version) {
+        tlv8_cache_entry_retain(entry);
+    }
+    else {
+        entry = NULL;
+    }
+    portEXIT_CRITICAL(&cache->entry_lock);
+    if (!entry) {
+        entry = tlv8_cache_refresh(cache);
+    }
+    return entry;
+}
+
+const unsigned char *tlv8_cache_entry_get_data(tlv8_cache_entry_t entry) {
+    return entry->data ? (const unsigned char *)buffer_get_data(entry->data) : NULL;
+}
+
+int tlv8_cache_entry_get_length(tlv8_cache_entry_t entry) {
+    return entry->data ? buffer_get_length(entry->data) : 0;
+}
+
+const char *tlv8_cache_entry_get_base64(tlv8_cache_entry_t entry) {
+    return entry->base64;
+}
+
+int tlv8_cache_entry_get_base64_length(tlv8_cache_entry_t entry) {
+    return entry->base64_len;
+}
+
+void tlv8_cache_entry_release(tlv8_cache_entry_t entry) {
+    if (entry && !__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL)) {
+        buffer_free(entry->data);
+        if (entry->base64) {
+            tlv8_mem_free(entry->allocator, entry->base64);
+        }
+        tlv8_mem_free(&tlv8_allocator_internal, entry);
+    }
+}
+
+void tlv8_cache_free(void *c) {
+    tlv8_cache_t cache = (tlv8_cache_t)c;
+    if (cache) {
+        tlv8_cache_entry_release(cache->entry);
+        vSemaphoreDelete(cache->lock);
+        tlv8_mem_free(&tlv8_allocator_internal, cache);
+    }
+}
+
+/***********************************************************************************************************
+ * TLV Ring
+ ***********************************************************************************************************
+ * Private interface
+ ***********************************************************************************************************/
+static void tlv8_ring_copy_in(tlv8_ring_t ring, uint32_t pos, const void *data, int len) {
+    uint32_t index = pos & ring->mask;
+    int first = min(len, (int)(ring->mask + 1 - index));
+    memcpy(ring->data + index, data, first);
+    memcpy(ring->data, (const unsigned char *)data + first, len - first);
+}
+
+static void tlv8_ring_copy_out(tlv8_ring_t ring, uint32_t pos, void *data, int len) {
+    uint32_t index = pos & ring->mask;
+    int first = min(len, (int)(ring->mask + 1 - index));
+    memcpy(data, ring->data + index, first);
+    memcpy((unsigned char *)data + first, ring->data, len - first);
+}
+
+/***********************************************************************************************************
+ * Public interface
+ ***********************************************************************************************************/
+tlv8_ring_t tlv8_ring_new(int size) {
+    if (size < 2 * TLV8_RING_HEADER_LEN || (size & (size - 1))) {
+        return NULL;
+    }
+    // Head and tail are shared atomically and must be in internal RAM, the data is not
+    tlv8_ring_t ring = (tlv8_ring_t)tlv8_mem_alloc(&tlv8_allocator_internal, sizeof(struct _tlv8_ring));
+    if (!ring) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(struct _tlv8_ring));
+    ring->data = (unsigned char *)tlv8_mem_alloc(tlv8_allocator, size);
+    if (!ring->data) {
+        tlv8_mem_free(&tlv8_allocator_internal, ring);
+        return NULL;
+    }
+    ring->allocator = tlv8_allocator;
+    ring->mask = size - 1;
+    return ring;
+}
+
+int tlv8_ring_reserve(tlv8_ring_t ring, int max_len) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t available = ring->mask + 1 - (ring->head - tail);
+    if (max_len < 0 || (uint32_t)max_len + TLV8_RING_HEADER_LEN > available) {
+        return TLV8_ERR_RING_FULL;
+    }
+    ring->reserved = 1;
+    ring->write = ring->head + TLV8_RING_HEADER_LEN;
+    ring->limit = ring->write + max_len;
+    return TLV8_ERR_OK;
+}
+
+int tlv8_ring_sink(void *r, const void *data, int len) {
+    tlv8_ring_t ring = (tlv8_ring_t)r;
+    if (!ring->reserved || (uint32_t)len > ring->limit - ring->write) {
+        return TLV8_ERR_RING_FULL;
+    }
+    tlv8_ring_copy_in(ring, ring->write, data, len);
+    ring->write+= len;
+    return TLV8_ERR_OK;
+}
+
+int tlv8_ring_publish(tlv8_ring_t ring) {
+    if (!ring->reserved) {
+        return TLV8_ERR_INVALID_TLV;
+    }
+    uint32_t len = ring->write - ring->head - TLV8_RING_HEADER_LEN;
+    unsigned char header[TLV8_RING_HEADER_LEN] = { len, len >> 8, len >> 16, len >> 24 };
+    tlv8_ring_copy_in(ring, ring->head, header, TLV8_RING_HEADER_LEN);
+    ring->reserved = 0;
+    // The message is written before the consumer can see it
+    __atomic_store_n(&ring->head, ring->write, __ATOMIC_RELEASE);
+    return TLV8_ERR_OK;
+}
+
+int tlv8_ring_peek(tlv8_ring_t ring, tlv8_span_t spans[2]) {
+    uint32_t tail = ring->tail;
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+        return 0;
+    }
+    unsigned char header[TLV8_RING_HEADER_LEN];
+    tlv8_ring_copy_out(ring, tail, header, TLV8_RING_HEADER_LEN);
+    int len = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+    uint32_t index = (tail + TLV8_RING_HEADER_LEN) & ring->mask;
+    int first = min(len, (int)(ring->mask + 1 - index));
+    ring->next = tail + TLV8_RING_HEADER_LEN + len;
+    spans[0].data = ring->data + index;
+    spans[0].len = first;
+    if (first == len) {
+        return 1;
+    }
+    spans[1].data = ring->data;
+    spans[1].len = len - first;
+    return 2;
+}
+
+void tlv8_ring_release(tlv8_ring_t ring) {
+    if (ring->next != ring->tail) {
+        // The message is read before the producer can overwrite it
+        __atomic_store_n(&ring->tail, ring->next, __ATOMIC_RELEASE);
+    }
+}
+
+void tlv8_ring_free(void *r) {
+    tlv8_ring_t ring = (tlv8_ring_t)r;
+    if (ring) {
+        tlv8_mem_free(ring->allocator, ring->data);
+        tlv8_mem_free(&tlv8_allocator_internal, ring);
     }
 }
 
@@ -502,7 +2345,9 @@ buffer_t tlv8_encode_array(const array_t array) {
         tlv8_t tlv = (tlv8_t)array_at(array, i);
         tlv8_encoder_encode(codec, tlv);
     }
-    return tlv8_encoder_detach_data(codec);
+    buffer_t data = tlv8_encoder_detach_data(codec);
+    tlv8_encoder_free(codec);
+    return data;
 }
 
 buffer_t tlv8_encode_list(int count, ...) {
@@ -515,12 +2360,19 @@ buffer_t tlv8_encode_list(int count, ...) {
         tlv8_free(tlv);
     }
     va_end(list);
-    return tlv8_encoder_detach_data(codec);
+    buffer_t data = tlv8_encoder_detach_data(codec);
+    tlv8_encoder_free(codec);
+    return data;
 }
 
 array_t tlv8_decode(const buffer_t buffer, const TLV8_DATA_TYPE *mapping) {
+    return tlv8_decode_with_allocator(buffer, mapping, tlv8_allocator);
+}
+
+array_t tlv8_decode_with_allocator(const buffer_t buffer, const TLV8_DATA_TYPE *mapping, const tlv8_allocator_t *allocator) {
     array_t array = array_new(tlv8_free);
-    tlv8_decoder_t decoder = tlv8_decoder_new(buffer);
+    // The buffer belongs to the caller, tlvs get their own copy of the data
+    tlv8_decoder_t decoder = tlv8_decoder_new_with_data_and_allocator(buffer_get_data(buffer), buffer_get_length(buffer), allocator);
     while (tlv8_decoder_has_next(decoder)) {
         uint8_t type = tlv8_decoder_peek_type(decoder);
         TLV8_DATA_TYPE data_type = mapping[type];
@@ -529,11 +2381,68 @@ array_t tlv8_decode(const buffer_t buffer, const TLV8_DATA_TYPE *mapping) {
             array_push(array, tlv);
         }
     }
-    tlv8_decoder_detach_data(decoder);
     tlv8_decoder_free(decoder);
     return array;
 }
 
+// Workers pick the next buffer index atomically, so results stay in order whatever the scheduling
+static void tlv8_decode_batch_run(tlv8_batch_t *batch) {
+    // Each worker takes its own allocator so workers don't contend on a shared heap
+    int worker = __atomic_fetch_add(&batch->workers, 1, __ATOMIC_RELAXED);
+    const tlv8_allocator_t *allocator = batch->allocators ? batch->allocators[worker] : tlv8_allocator;
+    int i;
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count) {
+        batch->results[i] = tlv8_decode_with_allocator(batch->buffers[i], batch->mapping, allocator);
+    }
+}
+
+static void tlv8_decode_batch_task(void *arg) {
+    tlv8_batch_t *batch = (tlv8_batch_t *)arg;
+    tlv8_decode_batch_run(batch);
+    xSemaphoreGive(batch->done);
+    vTaskDelete(NULL);
+}
+
+int tlv8_decode_batch(const buffer_t *buffers, int count, const TLV8_DATA_TYPE *mapping, array_t *results, int num_workers, const tlv8_allocator_t *const *allocators) {
+    tlv8_batch_t batch = {
+        .buffers = buffers,
+        .count = count,
+        .mapping = mapping,
+        .results = results,
+        .allocators = allocators,
+        .next = 0,
+        .workers = 0,
+        .done = NULL
+    };
+    int num_tasks = 0;
+    if (num_workers > count) {
+        num_workers = count;
+    }
+    if (num_workers > 1) {
+        batch.done = xSemaphoreCreateCounting(num_workers - 1, 0);
+        if (!batch.done) {
+            return TLV8_ERR_ALLOC_FAILED;
+        }
+        UBaseType_t priority = uxTaskPriorityGet(NULL);
+        for (; num_tasks < num_workers - 1; num_tasks++) {
+            if (xTaskCreate(tlv8_decode_batch_task, "tlv8_batch", TLV8_BATCH_STACK_SIZE, &batch, priority, NULL) != pdPASS) {
+                // Carry on with the workers we have
+                ESP_LOGW(TAG, "Batch decode started with %d workers instead of %d", num_tasks + 1, num_workers);
+                break;
+            }
+        }
+    }
+    // The caller is a worker too
+    tlv8_decode_batch_run(&batch);
+    for (int i = 0; i < num_tasks; i++) {
+        xSemaphoreTake(batch.done, portMAX_DELAY);
+    }
+    if (batch.done) {
+        vSemaphoreDelete(batch.done);
+    }
+    return TLV8_ERR_OK;
+}
+
 tlv8_t tlv8_tlv_of_type(array_t tlvs, uint8_t type) {
     for (int i = 0; i < array_count(tlvs); i++) {
         tlv8_t tlv = array_at(tlvs, i);